@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include <fumi_tools/dedup.hpp>
+#include <fumi_tools/read_flags.hpp>
+#include <fumi_tools/umi_opts.hpp>
+
+namespace {
+
+constexpr uint64_t num_positions = 20000;
+constexpr uint64_t reads_per_position = 10;
+constexpr int32_t read_length = 50;
+
+std::string random_umi(std::mt19937_64& rand_gen) {
+  std::string res(8, 'A');
+  for (auto& c : res) {
+    c = "ACGT"[rand_gen() % 4];
+  }
+  return res;
+}
+
+/**
+ * Writes a coordinate sorted SAM file with duplicated reads, every read
+ * carries its UMI in the read name and in the RX tag. Paired files contain
+ * some chimeric pairs and pairs with an unmapped mate.
+ */
+void write_input(const std::string& path, bool paired) {
+  std::mt19937_64 rand_gen(42);
+  // reference, position, line
+  std::vector<std::tuple<int32_t, int32_t, std::string>> records;
+  const char* refs[] = {"chr1", "chr2"};
+  const std::string seq(read_length, 'A');
+  const std::string qual(read_length, 'I');
+  auto add = [&](int32_t tid, int32_t pos, const std::string& name,
+                 int flag, int32_t mtid, int32_t mpos, int32_t tlen,
+                 const std::string& umi) {
+    auto mref = mtid < 0 ? "*" : mtid == tid ? "=" : refs[mtid];
+    records.emplace_back(
+        tid, pos,
+        fmt::format("{}_{}\t{}\t{}\t{}\t255\t{}M\t{}\t{}\t{}\t{}\t{}\tRX:Z:{}",
+                    name, umi, flag, refs[tid], pos + 1, read_length, mref,
+                    mpos + 1, tlen, seq, qual, umi));
+  };
+  uint64_t read_id = 0;
+  for (auto i = 0ul; i < num_positions; ++i) {
+    auto pos = static_cast<int32_t>(i * 50);
+    for (auto j = 0ul; j < reads_per_position; ++j) {
+      auto umi = random_umi(rand_gen);
+      auto name = fmt::format("r{}", read_id++);
+      auto reverse = rand_gen() % 2 == 0;
+      if (!paired) {
+        add(0, pos, name, reverse ? 16 : 0, -1, -1, 0, umi);
+        continue;
+      }
+      auto kind = rand_gen() % 20;
+      if (kind == 0) {
+        // mate unmapped
+        add(0, pos, name, 0x1 | 0x8 | 0x40, 0, pos, 0, umi);
+      } else if (kind == 1) {
+        // chimeric pair
+        add(0, pos, name, 0x1 | 0x40, 1, pos, 0, umi);
+        add(1, pos, name, 0x1 | 0x80, 0, pos, 0, umi);
+      } else {
+        auto mpos = pos + 150;
+        add(0, pos, name, 0x1 | 0x2 | 0x20 | 0x40, 0, mpos, 200, umi);
+        add(0, mpos, name, 0x1 | 0x2 | 0x10 | 0x80, 0, pos, -200, umi);
+      }
+    }
+  }
+  std::stable_sort(records.begin(), records.end(),
+                   [](const auto& lhs, const auto& rhs) {
+                     return std::tie(std::get<0>(lhs), std::get<1>(lhs)) <
+                            std::tie(std::get<0>(rhs), std::get<1>(rhs));
+                   });
+  std::ofstream out(path);
+  out << "@HD\tVN:1.6\tSO:coordinate\n"
+      << "@SQ\tSN:chr1\tLN:10000000\n"
+      << "@SQ\tSN:chr2\tLN:10000000\n";
+  for (auto& record : records) {
+    out << std::get<2>(record) << '\n';
+  }
+}
+
+/** Runs fun once and reports the elapsed time and the throughput. */
+template <class Fun>
+double run(const std::string& name, Fun fun) {
+  using clock = std::chrono::steady_clock;
+  auto start = clock::now();
+  fun();
+  std::chrono::duration<double> elapsed = clock::now() - start;
+  auto reads = num_positions * reads_per_position;
+  std::cout << fmt::format("{:<90} {:8.3f} s {:8.2f} M reads/s", name,
+                           elapsed.count(), reads / elapsed.count() / 1e6)
+            << std::endl;
+  return elapsed.count();
+}
+
+void run(const std::string& name,
+         const std::string& input,
+         const fumi_tools::umi_opts& opts) {
+  run(name, [&]() { fumi_tools::dedup(input, "/dev/null", opts); });
+}
+
+/**
+ * Compares deduplicating, sorting by name and fixing the flags in a single
+ * process with passing the deduplicated reads on as an uncompressed BAM
+ * file, as the former dedup | fix_flags pipeline did.
+ */
+void run_fix_flags(const std::string& input, const std::string& prefix) {
+  constexpr uint64_t sort_memory = 256ul << 20u;
+  auto intermediate = prefix + "_dedup.bam";
+  auto output = prefix + "_fixed.bam";
+  fumi_tools::umi_opts opts;
+  opts.paired = true;
+
+  auto separate = run("paired dedup | fix_flags --name-sort", [&]() {
+    auto dedup_opts = opts;
+    dedup_opts.uncompressed = true;
+    fumi_tools::dedup(input, intermediate, dedup_opts);
+    fumi_tools::fix_flags(intermediate, output, false, true, false,
+                          sort_memory, 1, 1, 1);
+  });
+  auto fused = run("paired dedup --fix-flags", [&]() {
+    auto fused_opts = opts;
+    fused_opts.fix_flags = true;
+    fused_opts.sort_memory = sort_memory;
+    fumi_tools::dedup(input, output, fused_opts);
+  });
+  std::cout << fmt::format("{:<90} {:8.2f} x", "fix flags speedup",
+                           separate / fused)
+            << std::endl;
+
+  std::remove(intermediate.c_str());
+  std::remove(output.c_str());
+}
+}  // namespace
+
+/**
+ * Deduplicates a generated input with every combination of the options that
+ * select a specialised dedup loop, then compares fixing the flags in the
+ * dedup process with fixing them in a separate step.
+ */
+int main() {
+  using fumi_tools::READ_HANDLING;
+  const char* tmp_dir = std::getenv("TMPDIR");
+  auto prefix = fmt::format("{}/fumi_tools_dedup_benchmark",
+                            tmp_dir != nullptr ? tmp_dir : "/tmp");
+  auto single_end_input = prefix + "_single_end.sam";
+  auto paired_input = prefix + "_paired.sam";
+  write_input(single_end_input, false);
+  write_input(paired_input, true);
+
+  for (auto read_length : {false, true}) {
+    for (auto spliced : {false, true}) {
+      for (auto umi_tag : {false, true}) {
+        fumi_tools::umi_opts opts;
+        opts.read_length = read_length;
+        opts.spliced = spliced;
+        opts.umi_tag = umi_tag ? "RX" : "";
+        run(fmt::format("single end read_length={} spliced={} umi_tag={}",
+                        read_length, spliced, umi_tag),
+            single_end_input, opts);
+      }
+    }
+  }
+
+  for (auto discard_unpaired : {false, true}) {
+    for (auto discard_chimeric : {false, true}) {
+      for (auto ignore_tlen : {false, true}) {
+        for (auto spliced : {false, true}) {
+          for (auto umi_tag : {false, true}) {
+            fumi_tools::umi_opts opts;
+            opts.paired = true;
+            opts.unpaired_reads = discard_unpaired ? READ_HANDLING::DISCARD
+                                                   : READ_HANDLING::USE;
+            opts.chimeric_pairs = discard_chimeric ? READ_HANDLING::DISCARD
+                                                   : READ_HANDLING::USE;
+            opts.ignore_tlen = ignore_tlen;
+            opts.spliced = spliced;
+            opts.umi_tag = umi_tag ? "RX" : "";
+            run(fmt::format("paired discard_unpaired={} discard_chimeric={} "
+                            "ignore_tlen={} spliced={} umi_tag={}",
+                            discard_unpaired, discard_chimeric, ignore_tlen,
+                            spliced, umi_tag),
+                paired_input, opts);
+          }
+        }
+      }
+    }
+  }
+
+  run_fix_flags(paired_input, prefix);
+
+  std::remove(single_end_input.c_str());
+  std::remove(paired_input.c_str());
+  return 0;
+}
@@ -0,0 +1,113 @@
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include <fumi_tools/hamming.hpp>
+
+namespace {
+
+std::vector<std::string> random_sequences(std::size_t n,
+                                          std::size_t length,
+                                          std::mt19937_64& rand_gen) {
+  std::vector<std::string> res(n, std::string(length, 'A'));
+  for (auto& seq : res) {
+    for (auto& c : seq) {
+      c = "ACGT"[rand_gen() % 4];
+    }
+  }
+  return res;
+}
+
+/** Runs fun repeatedly for about a second and reports the comparison rate. */
+template <class Fun>
+void run(const std::string& name, uint64_t comparisons, Fun fun) {
+  using clock = std::chrono::steady_clock;
+  uint64_t checksum = 0;
+  uint64_t iterations = 0;
+  auto start = clock::now();
+  std::chrono::duration<double> elapsed{};
+  do {
+    checksum += fun();
+    ++iterations;
+    elapsed = clock::now() - start;
+  } while (elapsed.count() < 1.0);
+  std::cout << fmt::format("{:<24} {:10.1f} M comparisons/s (checksum {})",
+                           name,
+                           comparisons * iterations / elapsed.count() / 1e6,
+                           checksum)
+            << std::endl;
+}
+}  // namespace
+
+int main() {
+  using namespace fumi_tools;
+  std::mt19937_64 rand_gen(42);
+  for (auto length : {8ul, 12ul, 32ul}) {
+    for (auto num_candidates : {16ul, 1024ul}) {
+      auto queries = random_sequences(256, length, rand_gen);
+      auto candidates = random_sequences(num_candidates, length, rand_gen);
+      std::vector<packed_sequence> packed_queries(queries.size());
+      for (auto i = 0ul; i < queries.size(); ++i) {
+        pack_sequence(queries[i], packed_queries[i]);
+      }
+      packed_sequences packed_candidates;
+      for (auto& seq : candidates) {
+        packed_sequence packed;
+        pack_sequence(seq, packed);
+        packed_candidates.push_back(packed);
+      }
+      std::vector<uint32_t> dists(num_candidates);
+      auto comparisons = queries.size() * num_candidates;
+
+      std::cout << fmt::format("length {}, {} candidates", length,
+                               num_candidates)
+                << std::endl;
+      run("scalar characters", comparisons, [&]() {
+        uint64_t sum = 0;
+        for (auto& query : queries) {
+          for (auto& candidate : candidates) {
+            for (auto i = 0ul; i < length; ++i) {
+              sum += query[i] != candidate[i];
+            }
+          }
+        }
+        return sum;
+      });
+      run("packed pairwise", comparisons, [&]() {
+        uint64_t sum = 0;
+        for (auto& query : packed_queries) {
+          for (auto i = 0ul; i < num_candidates; ++i) {
+            sum += hamming_distance(query, packed_candidates[i]);
+          }
+        }
+        return sum;
+      });
+      run("packed batch", comparisons, [&]() {
+        uint64_t sum = 0;
+        for (auto& query : packed_queries) {
+          hamming_distances(query, packed_candidates, 0, num_candidates,
+                            dists.data());
+          for (auto dist : dists) {
+            sum += dist;
+          }
+        }
+        return sum;
+      });
+      run("closest sequence", comparisons, [&]() {
+        uint64_t sum = 0;
+        for (auto& query : packed_queries) {
+          uint32_t min_dist = 0;
+          sum += closest_sequence(query, packed_candidates, min_dist);
+          sum += min_dist;
+        }
+        return sum;
+      });
+    }
+  }
+  return 0;
+}
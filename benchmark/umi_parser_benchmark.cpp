@@ -0,0 +1,110 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+#include <htslib/sam.h>
+
+#include <fumi_tools/umi_parser.hpp>
+
+namespace {
+
+std::string random_sequence(std::size_t length, std::mt19937_64& rand_gen) {
+  std::string res(length, 'A');
+  for (auto& c : res) {
+    c = "ACGT"[rand_gen() % 4];
+  }
+  return res;
+}
+
+/** Record with only a read name and the UMI in the RX tag. */
+bam1_t* make_record(const std::string& qname, const std::string& umi) {
+  auto* record = bam_init1();
+  auto l_qname = qname.size() + 1;
+  auto extranul = (4 - l_qname % 4) % 4;
+  record->m_data = static_cast<uint32_t>(l_qname + extranul);
+  record->data = static_cast<uint8_t*>(std::calloc(record->m_data, 1));
+  std::memcpy(record->data, qname.c_str(), qname.size());
+  record->core.l_qname = static_cast<uint8_t>(l_qname + extranul);
+  record->core.l_extranul = static_cast<uint8_t>(extranul);
+  record->l_data = static_cast<int>(record->m_data);
+  bam_aux_append(record, "RX", 'Z', static_cast<int>(umi.size() + 1),
+                 reinterpret_cast<const uint8_t*>(umi.c_str()));
+  return record;
+}
+
+/** Runs fun repeatedly for about a second and reports the time per record. */
+template <class Fun>
+void run(const std::string& name, uint64_t records, Fun fun) {
+  using clock = std::chrono::steady_clock;
+  uint64_t checksum = 0;
+  uint64_t iterations = 0;
+  auto start = clock::now();
+  std::chrono::duration<double> elapsed{};
+  do {
+    checksum += fun();
+    ++iterations;
+    elapsed = clock::now() - start;
+  } while (elapsed.count() < 1.0);
+  std::cout << fmt::format("{:<24} {:8.2f} ns/record (checksum {})", name,
+                           elapsed.count() * 1e9 / (records * iterations),
+                           checksum)
+            << std::endl;
+}
+}  // namespace
+
+int main() {
+  using namespace fumi_tools;
+  std::mt19937_64 rand_gen(42);
+  constexpr std::size_t num_records = 4096;
+  for (auto length : {8ul, 12ul, 32ul}) {
+    std::vector<std::string> underscore_names;
+    std::vector<std::string> fumi_names;
+    std::vector<bam1_t*> records;
+    for (auto i = 0ul; i < num_records; ++i) {
+      auto umi = random_sequence(length, rand_gen);
+      auto read_id =
+          fmt::format("NB501234:123:HXXXXXXXX:1:11101:{}:{}", i, i * 7);
+      underscore_names.push_back(fmt::format("{}_{}", read_id, umi));
+      fumi_names.push_back(fmt::format("{}:FUMI|{}| 1:N:0", read_id, umi));
+      records.push_back(make_record(read_id, umi));
+    }
+
+    std::cout << fmt::format("UMI length {}", length) << std::endl;
+    for (auto fmt : {UMI_FORMAT::UNDERSCORE, UMI_FORMAT::FUMI_TAG}) {
+      auto& names = fmt == UMI_FORMAT::UNDERSCORE ? underscore_names
+                                                  : fumi_names;
+      auto suffix = fmt == UMI_FORMAT::UNDERSCORE ? "underscore" : "fumi tag";
+      run(fmt::format("string {}", suffix), num_records, [&]() {
+        uint64_t sum = 0;
+        for (auto& name : names) {
+          sum += umi_key(get_umi(name, fmt)).hash();
+        }
+        return sum;
+      });
+      run(fmt::format("simd {}", suffix), num_records, [&]() {
+        uint64_t sum = 0;
+        for (auto& name : names) {
+          sum += parse_umi(name, fmt).hash();
+        }
+        return sum;
+      });
+    }
+    run("RX tag", num_records, [&]() {
+      uint64_t sum = 0;
+      for (auto* record : records) {
+        sum += parse_umi_tag(record, "RX").hash();
+      }
+      return sum;
+    });
+    for (auto* record : records) {
+      bam_destroy1(record);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,126 @@
+#ifndef FUMI_TOOLS_HAMMING_HPP
+#define FUMI_TOOLS_HAMMING_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <nonstd/string_view.hpp>
+
+namespace fumi_tools {
+
+/**
+ * Sequence of up to 32 bases with 2 bits per base, the first base is stored
+ * in the lowest two bits. N bases are stored as A and additionally set the
+ * lower bit of their base in mask, so N only matches N.
+ */
+struct packed_sequence {
+  static constexpr std::size_t max_length = 32;
+
+  uint64_t bases = 0;
+  uint64_t mask = 0;
+};
+
+/** Moves bit i of mask to bit 2 * i. */
+inline uint64_t spread_bits(uint32_t mask) {
+  uint64_t res = mask;
+  res = (res | (res << 16u)) & 0x0000FFFF0000FFFFull;
+  res = (res | (res << 8u)) & 0x00FF00FF00FF00FFull;
+  res = (res | (res << 4u)) & 0x0F0F0F0F0F0F0F0Full;
+  res = (res | (res << 2u)) & 0x3333333333333333ull;
+  res = (res | (res << 1u)) & 0x5555555555555555ull;
+  return res;
+}
+
+/**
+ * Packs seq into res, returns false if seq is too long or contains other
+ * characters than ACGTN.
+ */
+inline bool pack_sequence(nonstd::string_view seq, packed_sequence& res) {
+  if (seq.size() > packed_sequence::max_length) {
+    return false;
+  }
+  res = packed_sequence{};
+  for (auto i = 0u; i < seq.size(); ++i) {
+    uint64_t code = 0;
+    switch (seq[i]) {
+      case 'A':
+        break;
+      case 'C':
+        code = 1;
+        break;
+      case 'G':
+        code = 2;
+        break;
+      case 'T':
+        code = 3;
+        break;
+      case 'N':
+        res.mask |= 1ull << (2u * i);
+        break;
+      default:
+        return false;
+    }
+    res.bases |= code << (2u * i);
+  }
+  return true;
+}
+
+/** Number of mismatching bases of two sequences of the same length. */
+inline uint32_t hamming_distance(const packed_sequence& lhs,
+                                 const packed_sequence& rhs) {
+  auto diff = lhs.bases ^ rhs.bases;
+  diff = ((diff | (diff >> 1u)) & 0x5555555555555555ull) |
+         (lhs.mask ^ rhs.mask);
+  return static_cast<uint32_t>(__builtin_popcountll(diff));
+}
+
+/** Packed sequences stored as separate arrays of bases and masks. */
+class packed_sequences {
+ public:
+  void push_back(const packed_sequence& seq) {
+    bases_.push_back(seq.bases);
+    masks_.push_back(seq.mask);
+  }
+
+  void clear() {
+    bases_.clear();
+    masks_.clear();
+  }
+
+  std::size_t size() const { return bases_.size(); }
+
+  packed_sequence operator[](std::size_t i) const {
+    return {bases_[i], masks_[i]};
+  }
+
+  const uint64_t* bases() const { return bases_.data(); }
+  const uint64_t* masks() const { return masks_.data(); }
+
+ private:
+  std::vector<uint64_t> bases_;
+  std::vector<uint64_t> masks_;
+};
+
+/**
+ * Writes the hamming distance between query and the candidates [beg, end)
+ * to dists[0, end - beg). Uses AVX2 if the CPU supports it.
+ */
+void hamming_distances(const packed_sequence& query,
+                       const packed_sequences& candidates,
+                       std::size_t beg,
+                       std::size_t end,
+                       uint32_t* dists);
+
+/**
+ * Returns the index of the first candidate with the smallest hamming
+ * distance to query and stores the distance in min_dist. Returns
+ * candidates.size() if there are no candidates.
+ */
+std::size_t closest_sequence(const packed_sequence& query,
+                             const packed_sequences& candidates,
+                             uint32_t& min_dist);
+
+}  // namespace fumi_tools
+
+#endif  // FUMI_TOOLS_HAMMING_HPP
@@ -0,0 +1,151 @@
+#ifndef FUMI_TOOLS_NAME_SORT_HPP
+#define FUMI_TOOLS_NAME_SORT_HPP
+
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <htslib/bgzf.h>
+#include <htslib/sam.h>
+
+#include <nonstd/string_view.hpp>
+
+namespace fumi_tools {
+
+/**
+ * Read name up to the trailing whitespace, in case the aligner did not trim
+ * it off. Reads with the same canonical name belong to the same template.
+ */
+nonstd::string_view get_canonical_name(const bam1_t* record);
+
+/**
+ * Sets the SO field of the @HD header line, adding the line if necessary.
+ * The SS field is set to order:sub_sort, or removed if sub_sort is null.
+ */
+void set_sort_order(bam_hdr_t* bam_hdr,
+                    const char* order,
+                    const char* sub_sort = nullptr);
+
+/**
+ * Parses a memory size with an optional K, M or G suffix into bytes.
+ */
+uint64_t parse_memory(const std::string& mem);
+
+/**
+ * External memory sort by canonical read name. Records are copied into an
+ * arena until the run exceeds its share of max_memory, then the run is
+ * radix sorted on its names and spilled to a compressed temporary file.
+ * Up to threads - 1 runs are sorted and spilled on other threads while
+ * records are added, with a single thread add spills them itself. The runs
+ * are merged when the records are read back, at most 64 at a time: with
+ * more runs, groups of them are first merged into larger temporary runs.
+ * Records with the same canonical name keep the order in which they were
+ * added.
+ */
+class name_sorter {
+ public:
+  name_sorter(uint64_t max_memory, uint64_t threads);
+  name_sorter(const name_sorter&) = delete;
+  name_sorter& operator=(const name_sorter&) = delete;
+  ~name_sorter();
+
+  void add(const bam1_t* record);
+
+  /** Sorts the last run, afterwards the records can be read with next. */
+  void finish();
+
+  /** Reads the next record in name order, returns false at the end. */
+  bool next(bam1_t* record);
+
+ private:
+  class run;
+
+  struct merge_source {
+    // either the last run kept in memory or a spilled run
+    std::unique_ptr<run> memory;
+    std::size_t next = 0;
+    BGZF* file = nullptr;
+    std::unique_ptr<bam1_t, void (*)(bam1_t*)> head{nullptr, bam_destroy1};
+    nonstd::string_view name;
+  };
+
+  bool source_greater(std::size_t lhs, std::size_t rhs) const;
+  std::string temporary_path();
+  void spill_run();
+  void wait_for_spill();
+  void open_sources(std::size_t beg, std::size_t end);
+  void start_merge();
+  void close_sources();
+  void merge_runs(std::size_t beg, std::size_t end, const std::string& path);
+  bool advance(merge_source& source);
+
+  std::function<bool(std::size_t, std::size_t)> heap_greater_;
+  uint64_t run_memory_;
+  uint64_t max_spills_;
+  std::unique_ptr<run> run_;
+  std::vector<std::future<void>> spills_;
+  // all temporary files, removed by the destructor
+  std::vector<std::string> paths_;
+  // spilled runs in the order of their records
+  std::vector<std::string> runs_;
+  std::vector<merge_source> sources_;
+  // heap of indices into sources_, the smallest name first
+  std::vector<std::size_t> heap_;
+};
+
+/**
+ * Groups the alignments of reads in any order by canonical read name. The
+ * alignments of a read are collected in a hash table until there are as
+ * many alignments of R1, R2 and unpaired reads as their NH tag says, then
+ * the read is returned by next, its alignments one after another and in
+ * input order. Unmapped reads are dropped. If the collected reads exceed
+ * max_memory, they are spilled to temporary files partitioned by a hash of
+ * their name. Reads without NH tag, or that were spilled, are returned after
+ * the input is exhausted, one partition at a time. A partition that exceeds
+ * max_memory when it is loaded is partitioned again by another hash.
+ */
+class name_grouper {
+ public:
+  name_grouper(std::function<bool(bam1_t*)> read_next, uint64_t max_memory);
+  name_grouper(const name_grouper&) = delete;
+  name_grouper& operator=(const name_grouper&) = delete;
+  ~name_grouper();
+
+  /** Reads the next record grouped by name, returns false at the end. */
+  bool next(bam1_t* record);
+
+ private:
+  class table;
+
+  struct partition {
+    std::string path;
+    // how often the reads have been partitioned
+    std::size_t depth;
+  };
+
+  bool fill_ready();
+  void spill(std::size_t depth);
+  void close_partitions(std::size_t depth);
+
+  std::function<bool(bam1_t*)> read_next_;
+  uint64_t max_memory_;
+  std::unique_ptr<table> table_;
+  // alignments of complete reads, returned before reading on
+  std::vector<std::unique_ptr<bam1_t, void (*)(bam1_t*)>> ready_;
+  std::size_t next_ready_ = 0;
+  bool input_done_ = false;
+  // partitions that are being written
+  std::vector<BGZF*> partitions_;
+  // all temporary files, removed by the destructor
+  std::vector<std::string> paths_;
+  // written partitions, returned in this order
+  std::vector<partition> pending_;
+  std::size_t next_partition_ = 0;
+};
+
+}  // namespace fumi_tools
+
+#endif  // FUMI_TOOLS_NAME_SORT_HPP
@@ -0,0 +1,48 @@
+#ifndef FUMI_TOOLS_READ_FLAGS_HPP
+#define FUMI_TOOLS_READ_FLAGS_HPP
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include <htslib/sam.h>
+
+namespace fumi_tools {
+
+/**
+ * Fixes the primary flags and the NH, HI and XS tags of the reads returned
+ * by read_next, which returns false once there are no more reads, and writes
+ * them to outfile. The alignments of a read need to be adjacent, e.g. sorted
+ * by name. With sort_rsem, pairs are ordered such that R2 follows R1. With
+ * more than one thread, batches of reads are fixed in parallel and written
+ * in input order.
+ */
+void fix_read_flags(const std::function<bool(bam1_t*)>& read_next,
+                    bam_hdr_t* bam_hdr,
+                    bool sort_rsem,
+                    samFile* outfile,
+                    uint64_t threads);
+
+/**
+ * Fixes the flags of input, which is sorted by name first if name_sort is
+ * set, using up to max_memory bytes for sorting and threads threads. With
+ * unsorted, input can be in any order and the alignments of each read are
+ * grouped in memory, see name_grouper. Only if both files are BAM files, a
+ * single thread is used and neither name_sort nor unsorted is set, reads
+ * with a single alignment are copied to the output without decoding them,
+ * unless copy_raw is unset. The output is the same either way.
+ */
+void fix_flags(const std::string& input,
+               const std::string& output,
+               bool sort_rsem,
+               bool name_sort,
+               bool unsorted,
+               uint64_t max_memory,
+               uint64_t threads,
+               uint64_t ithreads,
+               uint64_t othreads,
+               bool copy_raw = true);
+
+}  // namespace fumi_tools
+
+#endif  // FUMI_TOOLS_READ_FLAGS_HPP
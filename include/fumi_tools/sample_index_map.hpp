@@ -9,6 +9,8 @@
 
 #include <zstr/zstr.hpp>
 
+#include <fumi_tools/hamming.hpp>
+
 namespace fumi_tools {
 
 class zofstream {
@@ -72,6 +74,9 @@ class sample_index_map {
 
   std::vector<std::vector<std::string>> i5_indices_;
   std::vector<std::vector<std::string>> i7_indices_;
+  // packed indices per lane, empty if an index of the lane cannot be packed
+  std::vector<packed_sequences> i5_packed_;
+  std::vector<packed_sequences> i7_packed_;
   mutable std::vector<std::vector<zofstream>> output_files_;
   std::vector<uint64_t> i7_length_;
   std::vector<uint64_t> i5_length_;
@@ -0,0 +1,98 @@
+#ifndef FUMI_TOOLS_SPSC_RING_HPP
+#define FUMI_TOOLS_SPSC_RING_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace fumi_tools {
+
+/**
+ * Bounded lock-free queue between exactly one producer and one consumer
+ * thread. push blocks while the ring is full and pop while it is empty,
+ * either side can close the ring to stop the other one.
+ */
+template <class T>
+class spsc_ring {
+ public:
+  explicit spsc_ring(std::size_t capacity) {
+    std::size_t size = 1;
+    while (size < capacity) {
+      size <<= 1u;
+    }
+    slots_.resize(size);
+    mask_ = size - 1;
+  }
+
+  /** Returns false if the ring has been closed, value is dropped then. */
+  bool push(T value) {
+    auto tail = tail_.load(std::memory_order_relaxed);
+    for (auto spins = 0u;
+         tail - head_.load(std::memory_order_acquire) > mask_; ++spins) {
+      if (closed_.load(std::memory_order_acquire)) {
+        return false;
+      }
+      backoff(spins);
+    }
+    slots_[tail & mask_] = std::move(value);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  /** Returns false if the ring is closed and empty. */
+  bool pop(T& value) {
+    auto head = head_.load(std::memory_order_relaxed);
+    for (auto spins = 0u; head == tail_.load(std::memory_order_acquire);
+         ++spins) {
+      if (closed_.load(std::memory_order_acquire)) {
+        // the producer might have pushed right before closing
+        if (head == tail_.load(std::memory_order_acquire)) {
+          return false;
+        }
+        break;
+      }
+      backoff(spins);
+    }
+    value = std::move(slots_[head & mask_]);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  /** Like pop, but returns false instead of waiting if the ring is empty. */
+  bool try_pop(T& value) {
+    auto head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    value = std::move(slots_[head & mask_]);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  void close() { closed_.store(true, std::memory_order_release); }
+
+ private:
+  /** Spins first, as batches usually arrive quickly, then starts sleeping. */
+  static void backoff(unsigned int spins) {
+    if (spins < 64) {
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+  }
+
+  std::vector<T> slots_;
+  std::size_t mask_ = 0;
+  // keep producer and consumer index on different cache lines
+  std::atomic<std::size_t> head_{0};
+  char padding_[64];
+  std::atomic<std::size_t> tail_{0};
+  std::atomic<bool> closed_{false};
+};
+
+}  // namespace fumi_tools
+
+#endif  // FUMI_TOOLS_SPSC_RING_HPP
@@ -0,0 +1,50 @@
+#ifndef FUMI_TOOLS_THREAD_POOL_HPP
+#define FUMI_TOOLS_THREAD_POOL_HPP
+
+#include <cstdint>
+#include <stdexcept>
+
+#include <htslib/hts.h>
+#include <htslib/thread_pool.h>
+
+namespace fumi_tools {
+
+/**
+ * htslib thread pool shared by the input and the output file. Its threads
+ * take the BGZF blocks of whichever file has work queued, so a single
+ * budget of threads decompresses while reads are mostly read and
+ * compresses while they are mostly written. Needs to outlive the files it
+ * is attached to.
+ */
+class hts_thread_pool {
+ public:
+  /** Does not start threads if threads is at most 1. */
+  explicit hts_thread_pool(uint64_t threads) {
+    if (threads > 1) {
+      pool_.pool = hts_tpool_init(static_cast<int>(threads));
+      if (pool_.pool == nullptr) {
+        throw std::runtime_error("Could not create thread pool!");
+      }
+    }
+  }
+  hts_thread_pool(const hts_thread_pool&) = delete;
+  hts_thread_pool& operator=(const hts_thread_pool&) = delete;
+  ~hts_thread_pool() {
+    if (pool_.pool != nullptr) {
+      hts_tpool_destroy(pool_.pool);
+    }
+  }
+
+  void attach(htsFile* file) {
+    if (pool_.pool != nullptr && hts_set_thread_pool(file, &pool_) != 0) {
+      throw std::runtime_error("Could not attach thread pool to file!");
+    }
+  }
+
+ private:
+  htsThreadPool pool_{nullptr, 0};
+};
+
+}  // namespace fumi_tools
+
+#endif  // FUMI_TOOLS_THREAD_POOL_HPP
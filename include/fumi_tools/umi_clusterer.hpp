@@ -1,41 +1,312 @@
 #ifndef FUMI_TOOLS_UMI_CLUSTERER_HPP
 #define FUMI_TOOLS_UMI_CLUSTERER_HPP
 
+#include <algorithm>
+#include <cstdint>
+#include <limits>
 #include <memory>
-#include <string>
-
-#include <nonstd/string_view.hpp>
+#include <numeric>
+#include <vector>
 
 #include <htslib/sam.h>
 
 #include <robin_hood/robin_hood.h>
 
+#include <fumi_tools/hamming.hpp>
 #include <fumi_tools/helper.hpp>
+#include <fumi_tools/umi_opts.hpp>
+#include <fumi_tools/umi_key.hpp>
 
 namespace fumi_tools {
+/**
+ * Collapses the UMIs of a position bundle. Apart from "unique", the methods
+ * follow UMI-tools: UMIs within max_ham_dist of each other are connected,
+ * "cluster" keeps one UMI per connected component, "adjacency" the fewest
+ * most abundant UMIs whose neighbours cover the component and "directional"
+ * only connects a UMI to neighbours with count <= (count + 1) / 2.
+ */
 class umi_clusterer {
  public:
-  explicit umi_clusterer(nonstd::string_view method = "unique"):
-        method_(method) {}
+  explicit umi_clusterer(METHOD method = METHOD::UNIQUE,
+                         unsigned int max_ham_dist = 1)
+      : method_(method), max_ham_dist_(max_ham_dist) {}
+
+  /**
+   * Bundle is a range of UMI groups with members umi, read and count, fun is
+   * called with each kept UMI group, in bundle order.
+   */
+  template <class Bundle, class Fun>
+  void operator()(Bundle& bundle, Fun fun) {
+    (*this)(bundle, fun, [](auto&) {});
+  }
+
+  /**
+   * Same as above, but additionally calls drop with each UMI group that is
+   * collapsed into another one.
+   */
+  template <class Bundle, class Keep, class Drop>
+  void operator()(Bundle& bundle, Keep keep, Drop drop) {
+    ++positions_;
+    total_umis_per_position_ += bundle.size();
+    max_umis_per_position_ =
+        std::max<uint64_t>(max_umis_per_position_, bundle.size());
 
-  template <class Fun>
-  void operator()(
-      robin_hood::unordered_flat_map<
-          std::string, std::pair<std::unique_ptr<bam1_t, bam1_t_deleter>, uint64_t>>&
-          bundle,
-          Fun fun) {
-    if (method_ == "unique") {
-        for(auto& umi_info: bundle){
-            fun(umi_info.second.first, umi_info.first, umi_info.second.second);
+    if (method_ == METHOD::UNIQUE || bundle.size() == 1) {
+      for (auto& umi_info : bundle) {
+        keep(umi_info);
+      }
+      return;
+    }
+
+    build_graph(bundle);
+    std::fill(keep_.begin(), keep_.end(), false);
+    if (method_ == METHOD::ADJACENCY) {
+      select_adjacency();
+    } else {
+      // cluster and directional keep the most abundant UMI of each component
+      std::fill(visited_.begin(), visited_.end(), false);
+      for (uint32_t rank = 0; rank < order_.size(); ++rank) {
+        if (!visited_[rank]) {
+          keep_[rank] = true;
+          collect_component(rank);
         }
+      }
     }
+
+    for (uint32_t rank = 0; rank < order_.size(); ++rank) {
+      kept_[order_[rank]] = keep_[rank];
+    }
+    for (auto i = 0ul; i < bundle.size(); ++i) {
+      if (kept_[i]) {
+        keep(bundle[i]);
+      } else {
+        drop(bundle[i]);
+      }
+    }
+  }
+
+  /** Adds the position statistics of other, e.g. of another thread. */
+  void merge(const umi_clusterer& other) {
+    positions_ += other.positions_;
+    total_umis_per_position_ += other.total_umis_per_position_;
+    max_umis_per_position_ =
+        std::max(max_umis_per_position_, other.max_umis_per_position_);
   }
 
+  uint64_t positions() const { return positions_; }
+  uint64_t total_umis_per_position() const { return total_umis_per_position_; }
+  uint64_t max_umis_per_position() const { return max_umis_per_position_; }
+
  private:
-  std::string method_;
+  /**
+   * Sorts the UMIs by decreasing count and connects all UMIs within the
+   * maximum hamming distance. Nodes are identified by their rank.
+   */
+  template <class Bundle>
+  void build_graph(const Bundle& bundle) {
+    auto n = bundle.size();
+    order_.resize(n);
+    std::iota(order_.begin(), order_.end(), 0u);
+    std::stable_sort(order_.begin(), order_.end(),
+                     [&bundle](uint32_t lhs, uint32_t rhs) {
+                       return bundle[lhs].count > bundle[rhs].count;
+                     });
+    if (neighbours_.size() < n) {
+      neighbours_.resize(n);
+    }
+    for (auto i = 0ul; i < n; ++i) {
+      neighbours_[i].clear();
+    }
+    visited_.resize(n);
+    keep_.resize(n);
+    kept_.resize(n);
+
+    // all UMIs of a bundle are distinct, so there is nothing to connect
+    if (max_ham_dist_ == 0) {
+      return;
+    }
+    if (!all_packed(bundle)) {
+      for (uint32_t i = 0; i < n; ++i) {
+        for (uint32_t j = i + 1; j < n; ++j) {
+          if (hamming_distance(bundle[order_[i]].umi, bundle[order_[j]].umi) <=
+              max_ham_dist_) {
+            add_edges(bundle, i, j);
+          }
+        }
+      }
+      return;
+    }
+
+    packed_.clear();
+    for (auto rank : order_) {
+      packed_.push_back(bundle[rank].umi.packed());
+    }
+    if (n >= min_indexed_bundle_size && bundle[0].umi.size() > max_ham_dist_) {
+      connect_indexed(bundle);
+      return;
+    }
+    dists_.resize(n);
+    for (uint32_t i = 0; i < n; ++i) {
+      hamming_distances(packed_[i], packed_, i + 1, n, dists_.data());
+      for (uint32_t j = i + 1; j < n; ++j) {
+        if (dists_[j - i - 1] <= max_ham_dist_) {
+          add_edges(bundle, i, j);
+        }
+      }
+    }
+  }
+
+  /** Adds the edges between the neighbouring nodes of rank i < j. */
+  template <class Bundle>
+  void add_edges(const Bundle& bundle, uint32_t i, uint32_t j) {
+    auto& lhs = bundle[order_[i]];
+    auto& rhs = bundle[order_[j]];
+    // lhs.count >= rhs.count because of the order
+    auto directional = method_ == METHOD::DIRECTIONAL;
+    if (!directional || lhs.count >= 2 * rhs.count - 1) {
+      neighbours_[i].push_back(j);
+    }
+    if (!directional || rhs.count >= 2 * lhs.count - 1) {
+      neighbours_[j].push_back(i);
+    }
+  }
+
+  /**
+   * The hamming kernels and the index need packed UMIs of the same length.
+   */
+  template <class Bundle>
+  bool all_packed(const Bundle& bundle) const {
+    auto length = bundle[0].umi.size();
+    return std::all_of(bundle.begin(), bundle.end(), [length](auto& group) {
+      return group.umi.is_packed() && group.umi.size() == length;
+    });
+  }
+
+  /**
+   * Finds neighbours with a pigeonhole index: if two UMIs are split into
+   * max_ham_dist + 1 segments and differ in at most max_ham_dist bases, at
+   * least one segment is identical. Only UMIs sharing a segment are compared.
+   * Needs at least max_ham_dist + 1 bases.
+   */
+  template <class Bundle>
+  void connect_indexed(const Bundle& bundle) {
+    auto n = static_cast<uint32_t>(bundle.size());
+    auto length = bundle[0].umi.size();
+    auto segments = max_ham_dist_ + 1;
+    if (segment_heads_.size() < segments) {
+      segment_heads_.resize(segments);
+    }
+    segment_next_.resize(static_cast<std::size_t>(segments) * n);
+    // stamp_[i] == j + 1 if i was already compared with j
+    stamp_.assign(n, 0);
+
+    for (uint32_t s = 0; s < segments; ++s) {
+      segment_heads_[s].clear();
+    }
+    for (uint32_t j = 0; j < n; ++j) {
+      auto umi = packed_[j];
+      for (uint32_t s = 0; s < segments; ++s) {
+        auto beg = s * length / segments;
+        auto end = (s + 1) * length / segments;
+        auto base_mask = (1ull << (2u * (end - beg))) - 1u;
+        // at most 16 bases per segment as max_ham_dist >= 1
+        auto key = ((umi.bases >> (2u * beg)) & base_mask) |
+                   ((umi.mask >> (2u * beg)) & base_mask) << 32u;
+        auto& next = segment_next_[static_cast<std::size_t>(s) * n + j];
+        auto inserted = segment_heads_[s].emplace(key, j);
+        if (inserted.second) {
+          next = no_node;
+          continue;
+        }
+        for (auto i = inserted.first->second; i != no_node;
+             i = segment_next_[static_cast<std::size_t>(s) * n + i]) {
+          if (stamp_[i] != j + 1) {
+            stamp_[i] = j + 1;
+            if (hamming_distance(packed_[i], umi) <= max_ham_dist_) {
+              add_edges(bundle, i, j);
+            }
+          }
+        }
+        next = inserted.first->second;
+        inserted.first->second = j;
+      }
+    }
+  }
+
+  /**
+   * Marks all nodes reachable from start as visited and stores them in
+   * component_.
+   */
+  void collect_component(uint32_t start) {
+    component_.clear();
+    component_.push_back(start);
+    visited_[start] = true;
+    for (auto i = 0ul; i < component_.size(); ++i) {
+      for (auto next : neighbours_[component_[i]]) {
+        if (!visited_[next]) {
+          visited_[next] = true;
+          component_.push_back(next);
+        }
+      }
+    }
+  }
+
+  /**
+   * Keeps the smallest number of most abundant UMIs of each component that
+   * together with their neighbours cover the whole component.
+   */
+  void select_adjacency() {
+    std::fill(visited_.begin(), visited_.end(), false);
+    covered_.assign(order_.size(), false);
+    for (uint32_t rank = 0; rank < order_.size(); ++rank) {
+      if (visited_[rank]) {
+        continue;
+      }
+      collect_component(rank);
+      std::sort(component_.begin(), component_.end());
+      auto uncovered = component_.size();
+      for (auto node : component_) {
+        keep_[node] = true;
+        if (!covered_[node]) {
+          covered_[node] = true;
+          --uncovered;
+        }
+        for (auto next : neighbours_[node]) {
+          if (!covered_[next]) {
+            covered_[next] = true;
+            --uncovered;
+          }
+        }
+        if (uncovered == 0) {
+          break;
+        }
+      }
+    }
+  }
+
+  static constexpr std::size_t min_indexed_bundle_size = 64;
+  static constexpr uint32_t no_node = std::numeric_limits<uint32_t>::max();
+
+  METHOD method_;
+  uint32_t max_ham_dist_;
   uint64_t max_umis_per_position_ = 0;
   uint64_t total_umis_per_position_ = 0;
   uint64_t positions_ = 0;
+
+  // scratch space reused between bundles
+  std::vector<uint32_t> order_;
+  std::vector<std::vector<uint32_t>> neighbours_;
+  std::vector<uint32_t> component_;
+  std::vector<bool> visited_;
+  std::vector<bool> covered_;
+  std::vector<bool> keep_;
+  std::vector<bool> kept_;
+  std::vector<robin_hood::unordered_flat_map<uint64_t, uint32_t>>
+      segment_heads_;
+  std::vector<uint32_t> segment_next_;
+  std::vector<uint32_t> stamp_;
+  packed_sequences packed_;
+  std::vector<uint32_t> dists_;
 };
 }  // namespace fumi_tools
 
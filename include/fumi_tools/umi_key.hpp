@@ -0,0 +1,167 @@
+#ifndef FUMI_TOOLS_UMI_KEY_HPP
+#define FUMI_TOOLS_UMI_KEY_HPP
+
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <ostream>
+#include <string>
+
+#include <nonstd/string_view.hpp>
+
+#include <robin_hood/robin_hood.h>
+
+#include <fumi_tools/hamming.hpp>
+
+namespace fumi_tools {
+
+/**
+ * UMI packed into an integer with 2 bits per base, N bases are marked in a
+ * separate mask. UMIs longer than 32bp or containing other characters are
+ * kept as string.
+ */
+class umi_key {
+ public:
+  static constexpr std::size_t max_packed_length = packed_sequence::max_length;
+
+  umi_key() = default;
+
+  explicit umi_key(nonstd::string_view umi)
+      : length_(static_cast<uint32_t>(umi.size())) {
+    if (umi.size() > max_packed_length || !pack(umi)) {
+      bases_ = 0;
+      n_mask_ = 0;
+      unpacked_ = std::make_shared<const std::string>(umi.to_string());
+    }
+  }
+
+  /** UMI of length bases that was already packed as bases and n_mask. */
+  umi_key(uint64_t bases, uint32_t n_mask, uint32_t length)
+      : bases_(bases), n_mask_(n_mask), length_(length) {}
+
+  bool is_packed() const { return unpacked_ == nullptr; }
+
+  std::size_t size() const { return length_; }
+
+  /** Packed bases, the first base is stored in the lowest two bits. */
+  uint64_t bases() const { return bases_; }
+
+  /** Bit i is set if base i is an N. */
+  uint32_t n_mask() const { return n_mask_; }
+
+  /** Packed UMI for the hamming kernels, only valid if is_packed(). */
+  packed_sequence packed() const { return {bases_, spread_bits(n_mask_)}; }
+
+  std::string to_string() const {
+    if (!is_packed()) {
+      return *unpacked_;
+    }
+    std::string res(length_, 'N');
+    for (auto i = 0u; i < length_; ++i) {
+      if ((n_mask_ & (1u << i)) == 0) {
+        res[i] = "ACGT"[(bases_ >> (2u * i)) & 3u];
+      }
+    }
+    return res;
+  }
+
+  std::size_t hash() const {
+    if (!is_packed()) {
+      return robin_hood::hash_bytes(unpacked_->data(), unpacked_->size());
+    }
+    return robin_hood::hash_int(bases_) ^
+           robin_hood::hash_int(static_cast<uint64_t>(n_mask_) << 32u |
+                                length_);
+  }
+
+  friend bool operator==(const umi_key& lhs, const umi_key& rhs) {
+    if (!lhs.is_packed() || !rhs.is_packed()) {
+      return !lhs.is_packed() && !rhs.is_packed() &&
+             *lhs.unpacked_ == *rhs.unpacked_;
+    }
+    return lhs.bases_ == rhs.bases_ && lhs.n_mask_ == rhs.n_mask_ &&
+           lhs.length_ == rhs.length_;
+  }
+
+  friend bool operator!=(const umi_key& lhs, const umi_key& rhs) {
+    return !(lhs == rhs);
+  }
+
+  friend std::ostream& operator<<(std::ostream& out, const umi_key& lhs) {
+    return out << lhs.to_string();
+  }
+
+  /**
+   * Number of differing bases, N only matches N. UMIs of different length
+   * have no finite distance and return max().
+   */
+  friend uint32_t hamming_distance(const umi_key& lhs, const umi_key& rhs) {
+    if (lhs.length_ != rhs.length_) {
+      return std::numeric_limits<uint32_t>::max();
+    }
+    if (!lhs.is_packed() || !rhs.is_packed()) {
+      auto lhs_umi = lhs.to_string();
+      auto rhs_umi = rhs.to_string();
+      uint32_t dist = 0;
+      for (auto i = 0ul; i < lhs_umi.size(); ++i) {
+        dist += lhs_umi[i] != rhs_umi[i];
+      }
+      return dist;
+    }
+    return hamming_distance(lhs.packed(), rhs.packed());
+  }
+
+ private:
+  static constexpr int8_t n_code = 4;
+
+  bool pack(nonstd::string_view umi) {
+    for (auto i = 0u; i < umi.size(); ++i) {
+      auto code = encode_base(umi[i]);
+      if (code < 0) {
+        return false;
+      }
+      if (code == n_code) {
+        n_mask_ |= 1u << i;
+      } else {
+        bases_ |= static_cast<uint64_t>(code) << (2u * i);
+      }
+    }
+    return true;
+  }
+
+  static int8_t encode_base(char c) {
+    switch (c) {
+      case 'A':
+        return 0;
+      case 'C':
+        return 1;
+      case 'G':
+        return 2;
+      case 'T':
+        return 3;
+      case 'N':
+        return n_code;
+      default:
+        return -1;
+    }
+  }
+
+  uint64_t bases_ = 0;
+  uint32_t n_mask_ = 0;
+  uint32_t length_ = 0;
+  // only set for UMIs that cannot be packed
+  std::shared_ptr<const std::string> unpacked_;
+};
+}  // namespace fumi_tools
+
+namespace std {
+template <>
+struct hash<fumi_tools::umi_key> {
+  std::size_t operator()(const fumi_tools::umi_key& lhs) const noexcept {
+    return lhs.hash();
+  }
+};
+}  // namespace std
+
+#endif  // FUMI_TOOLS_UMI_KEY_HPP
@@ -6,21 +6,34 @@
 
 namespace fumi_tools {
 
+enum class METHOD { UNIQUE, CLUSTER, ADJACENCY, DIRECTIONAL };
+enum class READ_HANDLING { USE, DISCARD };
+
 struct umi_opts {
   unsigned int max_ham_dist = 1;
   bool read_length = false;
   uint32_t soft_clip_threshold = 4;
   bool spliced = false;
   uint64_t seed = 42;
-  std::string method = "unique";
+  METHOD method = METHOD::UNIQUE;
+  std::string umi_tag;
   bool uncompressed = false;
   uint64_t ithreads = 1;
   uint64_t othreads = 1;
+  uint64_t threads = 1;
+  uint64_t max_orphan_memory = 1ul << 30u;
+  // 0 means no limit
+  uint64_t max_memory = 0;
   bool paired = false;
   bool ignore_tlen = false;
-  std::string unpaired_reads = "use";
-  std::string chimeric_pairs = "use";
-  std::string unmapped_reads = "discard";
+  READ_HANDLING unpaired_reads = READ_HANDLING::USE;
+  READ_HANDLING chimeric_pairs = READ_HANDLING::USE;
+  READ_HANDLING unmapped_reads = READ_HANDLING::DISCARD;
+  bool coordinate_order = false;
+  bool mark_duplicates = false;
+  bool fix_flags = false;
+  bool sort_adjacent_pairs = false;
+  uint64_t sort_memory = 3ul << 30u;
 };
 
 }  // namespace fumi_tools
@@ -0,0 +1,46 @@
+#ifndef FUMI_TOOLS_UMI_PARSER_HPP
+#define FUMI_TOOLS_UMI_PARSER_HPP
+
+#include <nonstd/string_view.hpp>
+
+#include <htslib/sam.h>
+
+#include <fumi_tools/umi_key.hpp>
+
+namespace fumi_tools {
+
+enum class UMI_FORMAT { UNDERSCORE, FUMI_TAG, UNKNOWN };
+
+/**
+ * Read name of a record without the trailing NUL characters.
+ */
+inline nonstd::string_view get_qname(const bam1_t* record) {
+  return {bam_get_qname(record),
+          static_cast<std::size_t>(record->core.l_qname -
+                                   record->core.l_extranul - 1)};
+}
+
+/**
+ * Either READID_UMISEQ or READID:FUMI|UMISEQ|. Throws if qname contains no
+ * valid UMI.
+ */
+UMI_FORMAT determine_umi_format(nonstd::string_view qname);
+
+/** UMI part of qname, throws if it cannot be found. */
+nonstd::string_view get_umi(nonstd::string_view qname, UMI_FORMAT fmt);
+
+/**
+ * Same as umi_key(get_umi(qname, fmt)), but locates the UMI with SIMD
+ * compares and validates and packs its bases in the same pass.
+ */
+umi_key parse_umi(nonstd::string_view qname, UMI_FORMAT fmt);
+
+/**
+ * UMI stored in the string tag of record, e.g. RX or OX. Throws if the tag
+ * is missing.
+ */
+umi_key parse_umi_tag(const bam1_t* record, const char tag[2]);
+
+}  // namespace fumi_tools
+
+#endif  // FUMI_TOOLS_UMI_PARSER_HPP
@@ -1,100 +1,44 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <iostream>
-#include <random>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
 #include <fmt/format.h>
 #include <htslib/sam.h>
 #include <robin_hood/robin_hood.h>
 #include <cpg/cpg.hpp>
+#include <ghc/filesystem.hpp>
 #include <nonstd/optional.hpp>
 #include <nonstd/string_view.hpp>
 
 #include <fumi_tools/cast_helper.hpp>
 #include <fumi_tools/dedup.hpp>
 #include <fumi_tools/helper.hpp>
+#include <fumi_tools/name_sort.hpp>
+#include <fumi_tools/read_flags.hpp>
+#include <fumi_tools/spsc_ring.hpp>
+#include <fumi_tools/thread_pool.hpp>
 #include <fumi_tools/umi_clusterer.hpp>
+#include <fumi_tools/umi_key.hpp>
+#include <fumi_tools/umi_parser.hpp>
+
+#include <unistd.h>
 
 #define SHOW_DEBUG_OUTPUT false
 
 namespace fumi_tools {
 
 namespace {
-std::mt19937 rand_gen;
-std::uniform_real_distribution<> udistrib(0, 1);
-
-enum class UMI_FORMAT { UNDERSCORE, FUMI_TAG, UNKNOWN };
-
-// either READID_UMISEQ
-// or READID:FUMI|UMISEQ|
-UMI_FORMAT determine_umi_format(const char* c, uint8_t len) {
-  auto res = nonstd::string_view(c, len);
-  auto fmt = UMI_FORMAT::FUMI_TAG;
-  auto pos = res.find(":FUMI|");
-  nonstd::string_view umi;
-  if (pos == nonstd::string_view::npos) {
-    pos = res.rfind('_');
-    fmt = UMI_FORMAT::UNDERSCORE;
-    if (pos != nonstd::string_view::npos) {
-      umi = res.substr(pos + 1);
-      auto pos2 = umi.find(' ');
-      if (pos2 != nonstd::string_view::npos) {
-        umi = umi.substr(0, pos2);
-      }
-    }
-  } else {
-    umi = res.substr(pos + 6);
-    auto pos2 = umi.find('|');
-    if (pos2 != nonstd::string_view::npos) {
-      umi = umi.substr(0, pos2);
-    } else {
-      pos = nonstd::string_view::npos;
-    }
-  }
-  if (pos == nonstd::string_view::npos) {
-    throw std::runtime_error(
-        fmt::format("Did not find UMI for read {}!", res.to_string()));
-  }
-  if (umi.find_first_not_of("ACGTN") != nonstd::string_view::npos) {
-    throw std::runtime_error(fmt::format(
-        "Could not identify a valid UMI for read {}!", res.to_string()));
-  }
-  return fmt;
-}
-
-nonstd::string_view get_umi(const char* c, uint8_t len, UMI_FORMAT fmt) {
-  auto res = nonstd::string_view(c, len);
-  if (fmt == UMI_FORMAT::UNDERSCORE) {
-    auto pos = res.rfind('_');
-    if (pos == nonstd::string_view::npos) {
-      throw std::runtime_error(
-          fmt::format("Did not find umi for read {}!", res.to_string()));
-    }
-    auto umi = res.substr(pos + 1);
-    auto pos2 = umi.find(' ');
-    if (pos2 == nonstd::string_view::npos) {
-      return umi;
-    } else {
-      return umi.substr(0, pos2);
-    }
-  } else if (fmt == UMI_FORMAT::FUMI_TAG) {
-    auto pos = res.find(":FUMI|");
-    if (pos == nonstd::string_view::npos) {
-      throw std::runtime_error(
-          fmt::format("Did not find umi for read {}!", res.to_string()));
-    }
-    auto umi = res.substr(pos + 6);
-    auto pos2 = umi.find('|');
-    if (pos2 != nonstd::string_view::npos) {
-      return umi.substr(0, pos2);
-    } else {
-      throw std::runtime_error(
-          fmt::format("Did not find umi for read {}!", res.to_string()));
-    }
-  } else {
-    throw std::runtime_error("Unknown UMI format!");
-  }
-}
-
 /**
  * Takes a cigar string and finds the first splice position as
     an offset from the start. To find the 5' end (read coords) of
@@ -175,72 +119,60 @@ std::tuple<int64_t, int64_t, bool> get_read_position(
   }
 }
 
-struct custom_bam1_hash {
-  template <typename deleter>
-  std::size_t operator()(const std::unique_ptr<bam1_t, deleter>& lhs) const {
-    return this->operator()(lhs.get());
-  }
-
-  std::size_t operator()(const bam1_t* lhs) const {
-    auto hi_lhs = bam_aux_get(lhs, "HI");
-    auto hi_lhs_int = hi_lhs == nullptr ? 0 : bam_aux2i(hi_lhs);
-    return robin_hood::hash_int(static_cast<uint64_t>(lhs->core.pos)) ^
-           robin_hood::hash_int(static_cast<uint64_t>(lhs->core.tid)) ^
-           robin_hood::hash_bytes(bam_get_qname(lhs),
-                                  std::strlen(bam_get_qname(lhs))) ^
-           robin_hood::hash_int(static_cast<uint64_t>(lhs->core.mpos)) ^
-           robin_hood::hash_int(static_cast<uint64_t>(lhs->core.mtid)) ^
-           robin_hood::hash_int(static_cast<uint64_t>(lhs->core.isize)) ^
-           robin_hood::hash_int(static_cast<uint64_t>(hi_lhs_int));
-  }
+/**
+ * Identifies a paired read by the hash of its name, its position, the
+ * position of its mate, the template length and the HI tag. Computed once
+ * per read, such that looking up a mate does not parse tags or hash names.
+ */
+struct mate_key {
+  uint64_t qname_hash;
+  int32_t tid;
+  int32_t pos;
+  int32_t mtid;
+  int32_t mpos;
+  int32_t isize;
+  int32_t hi;
 };
 
-struct custom_bam1_eq {
-  template <typename deleter>
-  bool operator()(const std::unique_ptr<bam1_t, deleter>& lhs,
-                  const std::unique_ptr<bam1_t, deleter>& rhs) const {
-    return this->operator()(lhs.get(), rhs.get());
-  }
+mate_key make_mate_key(const bam1_t& read) {
+  auto* hi = bam_aux_get(&read, "HI");
+  auto* qname = bam_get_qname(&read);
+  return {robin_hood::hash_bytes(qname, std::strlen(qname)),
+          read.core.tid,
+          read.core.pos,
+          read.core.mtid,
+          read.core.mpos,
+          read.core.isize,
+          hi == nullptr ? 0 : static_cast<int32_t>(bam_aux2i(hi))};
+}
 
-  bool operator()(const bam1_t* lhs, const bam1_t* rhs) const {
-    auto check1 =
-        lhs->core.pos == rhs->core.pos && lhs->core.tid == rhs->core.tid &&
-        lhs->core.mpos == rhs->core.mpos && lhs->core.mtid == rhs->core.mtid &&
-        lhs->core.isize == rhs->core.isize;
-    if (!check1 || nonstd::string_view(bam_get_qname(lhs),
-                                       std::strlen(bam_get_qname(lhs))) !=
-                       nonstd::string_view(bam_get_qname(rhs),
-                                           std::strlen(bam_get_qname(rhs)))) {
-      return false;
-    } else {
-      auto hi_lhs = bam_aux_get(lhs, "HI");
-      bool same_hi = true;
-      if (hi_lhs != nullptr) {
-        auto hi_rhs = bam_aux_get(rhs, "HI");
-        if (hi_rhs) {
-          same_hi = bam_aux2i(hi_lhs) == bam_aux2i(hi_rhs);
-        }
-      }
-      return same_hi;
-    }
-  }
-};
+/**
+ * Returns the key of the mate of the read with the given key.
+ */
+mate_key mate_of(const mate_key& key) {
+  return {key.qname_hash, key.mtid, key.mpos, key.tid,
+          key.pos,        -key.isize, key.hi};
+}
+
+bool operator==(const mate_key& lhs, const mate_key& rhs) {
+  return lhs.qname_hash == rhs.qname_hash && lhs.tid == rhs.tid &&
+         lhs.pos == rhs.pos && lhs.mtid == rhs.mtid && lhs.mpos == rhs.mpos &&
+         lhs.isize == rhs.isize && lhs.hi == rhs.hi;
+}
 
-bam1_t build_mate_bam1_dummy(const bam1_t& read) {
-  bam1_t dummy;
-  dummy.core.pos = read.core.mpos;
-  dummy.core.tid = read.core.mtid;
-  dummy.core.n_cigar = read.core.n_cigar;
-  dummy.core.l_qname = read.core.l_qname;
-  dummy.core.l_qseq = read.core.l_qseq;
-  dummy.core.mpos = read.core.pos;
-  dummy.core.mtid = read.core.tid;
-  dummy.core.isize = -read.core.isize;
-  dummy.data = read.data;
-  dummy.l_data = read.l_data;
-  return dummy;
+bool operator<(const mate_key& lhs, const mate_key& rhs) {
+  return std::tie(lhs.qname_hash, lhs.tid, lhs.pos, lhs.mtid, lhs.mpos,
+                  lhs.isize, lhs.hi) < std::tie(rhs.qname_hash, rhs.tid,
+                                                rhs.pos, rhs.mtid, rhs.mpos,
+                                                rhs.isize, rhs.hi);
 }
 
+struct mate_key_hash {
+  std::size_t operator()(const mate_key& lhs) const {
+    return robin_hood::hash_bytes(&lhs, sizeof(mate_key));
+  }
+};
+
 bool read_is_potentially_after_mate(const bam1_t& read) {
   return (read.core.mtid < read.core.tid ||
           (read.core.mtid == read.core.tid && read.core.pos >= read.core.mpos));
@@ -251,450 +183,2885 @@ bool read_is_after_mate(const bam1_t& read) {
           (read.core.mtid == read.core.tid && read.core.pos > read.core.mpos));
 }
 
-template <class ReadGroup, bool is_paired>
-void update_read_map(
-    bam1_t* read,
-    int64_t pos,
-    ReadGroup key,
-    std::string umi,
-    robin_hood::unordered_flat_map<
-        int64_t,
-        robin_hood::unordered_flat_map<
-            ReadGroup,
-            robin_hood::unordered_flat_map<
-                std::string,
-                std::pair<std::unique_ptr<bam1_t, bam1_t_deleter>, uint64_t>>>>&
-        read_map,
-    robin_hood::unordered_flat_map<
-        int64_t,
-        robin_hood::unordered_flat_map<
-            ReadGroup,
-            robin_hood::unordered_flat_map<std::string, uint64_t>>>&
-        read_counts,
-    robin_hood::unordered_flat_set<std::unique_ptr<bam1_t, bam1_t_deleter>,
-                                   custom_bam1_hash,
-                                   custom_bam1_eq>& paired_read_map,
-    robin_hood::unordered_set<bam1_t*, custom_bam1_hash, custom_bam1_eq>&
-        current_reads) {
-  auto it = read_map[pos][key].find(umi);
-  if (it != std::end(read_map[pos][key])) {
-    auto& res = it->second;
-    res.second += 1;
-    auto read_qual = read->core.qual;
-    auto other_qual = res.first->core.qual;
-    if (read_qual < other_qual) {
-      // bad qual so drop pair
-      if (is_paired && read_is_potentially_after_mate(*read)) {
-        bam1_t dummy = build_mate_bam1_dummy(*read);
-        std::unique_ptr<bam1_t, bam1_t_deleter> dummy_ptr(&dummy);
-        paired_read_map.erase(dummy_ptr);
-        dummy_ptr.release();
-      }
-      return;
+/**
+ * Counts the positions of the reads of a single reference that are retained
+ * at a time. Reads are added in coordinate order, so the counts are kept in
+ * a window starting at the smallest retained position.
+ */
+class position_counter {
+ public:
+  void add(int32_t pos) {
+    if (total_ == 0) {
+      counts_.clear();
+      base_ = pos;
     }
-    if (read_qual > other_qual) {
-      // replace with other read, so remove paired
-      if (is_paired && read_is_potentially_after_mate(*res.first)) {
-        bam1_t dummy = build_mate_bam1_dummy(*res.first);
-        std::unique_ptr<bam1_t, bam1_t_deleter> dummy_ptr(&dummy);
-        paired_read_map.erase(dummy_ptr);
-        dummy_ptr.release();
-      }
-      if (is_paired) {
-        current_reads.erase(res.first.get());
-      }
-      auto* new_read = bam_dup1(read);
-      res.first.reset(new_read);
-      if (is_paired) {
-        current_reads.insert(new_read);
-      }
-      read_counts[pos][key][umi] = 0;
-      return;
+    if (pos < base_) {
+      counts_.insert(counts_.begin(), static_cast<std::size_t>(base_ - pos), 0);
+      base_ = pos;
     }
-    auto& count_res = read_counts[pos][key][umi];
-    ++count_res;
-    auto prob = 1.0 / count_res;
+    auto offset = static_cast<std::size_t>(pos - base_);
+    if (offset >= counts_.size()) {
+      counts_.resize(offset + 1, 0);
+    }
+    ++counts_[offset];
+    ++total_;
+  }
 
-    if (udistrib(rand_gen) < prob) {
-      if (is_paired && read_is_potentially_after_mate(*res.first)) {
-        bam1_t dummy = build_mate_bam1_dummy(*res.first);
-        std::unique_ptr<bam1_t, bam1_t_deleter> dummy_ptr(&dummy);
-        paired_read_map.erase(dummy_ptr);
-        dummy_ptr.release();
-      }
-      if (is_paired) {
-        current_reads.erase(res.first.get());
-      }
-      auto* new_read = bam_dup1(read);
-      res.first.reset(new_read);
-      if (is_paired) {
-        current_reads.insert(new_read);
-      }
+  void remove(int32_t pos) {
+    --counts_[static_cast<std::size_t>(pos - base_)];
+    --total_;
+    while (!counts_.empty() && counts_.front() == 0) {
+      counts_.pop_front();
+      ++base_;
+    }
+  }
+
+  /** Smallest retained position, max() if there is none. */
+  int32_t min() const {
+    return total_ == 0 ? std::numeric_limits<int32_t>::max() : base_;
+  }
+
+ private:
+  std::deque<uint32_t> counts_;
+  int32_t base_ = 0;
+  uint64_t total_ = 0;
+};
+
+uint64_t record_bytes(const bam1_t& read) {
+  return sizeof(bam1_t) + read.m_data;
+}
+
+/**
+ * Bytes of a robin_hood flat table with the given number of entries, which
+ * stores an extra info byte per slot and is filled to at most 80%.
+ */
+template <class Value>
+uint64_t table_bytes(std::size_t entries) {
+  return entries * (sizeof(Value) + 1) * 5 / 4;
+}
+
+/**
+ * Free list of records, such that retained reads reuse the records and data
+ * buffers of reads that have already been output instead of allocating new
+ * ones. Accounts the bytes of the records in use and of the free records.
+ * Optionally counts the positions of the records that are in use.
+ */
+class record_pool {
+ public:
+  explicit record_pool(bool count_positions = false)
+      : count_positions_(count_positions) {}
+  record_pool(const record_pool&) = delete;
+  record_pool& operator=(const record_pool&) = delete;
+
+  ~record_pool() {
+    for (auto* read : free_reads_) {
+      bam_destroy1(read);
+    }
+  }
+
+  bam1_t* copy(const bam1_t* read) {
+    bam1_t* res = nullptr;
+    if (free_reads_.empty()) {
+      res = bam_init1();
     } else {
-      // bad qual so drop pair
-      if (is_paired && read_is_potentially_after_mate(*read)) {
-        bam1_t dummy = build_mate_bam1_dummy(*read);
-        std::unique_ptr<bam1_t, bam1_t_deleter> dummy_ptr(&dummy);
-        paired_read_map.erase(dummy_ptr);
-        dummy_ptr.release();
-      }
+      res = free_reads_.back();
+      free_reads_.pop_back();
+      free_bytes_ -= record_bytes(*res);
     }
-  } else {
-    auto* new_read = bam_dup1(read);
-    if (is_paired) {
-      current_reads.insert(new_read);
+    bam_copy1(res, read);
+    bytes_ += record_bytes(*res);
+    if (count_positions_) {
+      positions_.add(res->core.pos);
     }
-    read_map[pos][key][umi] = {
-        std::unique_ptr<bam1_t, bam1_t_deleter>(new_read), 1ul};
-    read_counts[pos][key][umi] = 0;
+    return res;
   }
-}
 
-template <class ReadGroup>
-std::ostream& operator<<(
-    std::ostream& out,
-    const robin_hood::unordered_flat_map<
-        ReadGroup,
-        robin_hood::unordered_flat_map<
-            std::string,
-            std::pair<std::unique_ptr<bam1_t, bam1_t_deleter>, uint64_t>>>&
-        lhs) {
-  out << '{';
-  for (auto& e : lhs) {
-    out << e.first << ':';
-    for (auto& el : e.second) {
-      out << el.first << ' ';
+  void give(bam1_t* read) {
+    if (count_positions_) {
+      positions_.remove(read->core.pos);
     }
-    out << '\n';
+    bytes_ -= record_bytes(*read);
+    free_bytes_ += record_bytes(*read);
+    free_reads_.push_back(read);
   }
-  out << '}';
-  return out;
-}
 
-std::ostream& operator<<(std::ostream& out,
-                         const robin_hood::unordered_flat_set<
-                             std::unique_ptr<bam1_t, bam1_t_deleter>,
-                             custom_bam1_hash,
-                             custom_bam1_eq>& lhs) {
-  out << '{';
-  for (auto& e : lhs) {
-    out << bam_get_qname(e) << '|' << e->core.pos << ",\n";
+  /** Frees the records kept for reuse. */
+  void trim() {
+    for (auto* read : free_reads_) {
+      bam_destroy1(read);
+    }
+    free_reads_.clear();
+    free_reads_.shrink_to_fit();
+    free_bytes_ = 0;
   }
-  out << '}';
-  return out;
+
+  /** Bytes of the records in use. */
+  uint64_t bytes() const { return bytes_; }
+
+  /** Bytes of the records kept for reuse. */
+  uint64_t free_bytes() const {
+    return free_bytes_ + free_reads_.capacity() * sizeof(bam1_t*);
+  }
+
+  /** Smallest position of the records in use, needs count_positions. */
+  int32_t min_position() const { return positions_.min(); }
+
+ private:
+  std::vector<bam1_t*> free_reads_;
+  uint64_t bytes_ = 0;
+  uint64_t free_bytes_ = 0;
+  bool count_positions_;
+  position_counter positions_;
+};
+
+struct pooled_bam1_deleter {
+  record_pool* pool = nullptr;
+
+  void operator()(bam1_t* read) const {
+    if (pool != nullptr) {
+      pool->give(read);
+    } else {
+      bam_destroy1(read);
+    }
+  }
+};
+
+using bam1_ptr = std::unique_ptr<bam1_t, bam1_t_deleter>;
+using pooled_bam1_ptr = std::unique_ptr<bam1_t, pooled_bam1_deleter>;
+template <class Ptr>
+using mate_map_t = robin_hood::unordered_flat_map<mate_key, Ptr, mate_key_hash>;
+using mate_map = mate_map_t<bam1_ptr>;
+using pooled_mate_map = mate_map_t<pooled_bam1_ptr>;
+using mate_key_set = robin_hood::unordered_flat_set<mate_key, mate_key_hash>;
+
+/**
+ * Kept read of a UMI group as passed to the umi_clusterer, together with the
+ * number of reads in the group.
+ */
+struct umi_group {
+  umi_key umi;
+  pooled_bam1_ptr read;
+  uint64_t count;
+  mate_key key{};
+};
+
+using umi_bundle = std::vector<umi_group>;
+
+pooled_bam1_ptr pooled_copy(record_pool& pool, const bam1_t* read) {
+  return pooled_bam1_ptr(pool.copy(read), pooled_bam1_deleter{&pool});
 }
-}  // namespace
 
-template <class ReadGroup, bool is_paired, class Fun>
-void process_bam_read_chunks_helper(samFile* file,
-                                    bam_hdr_t* bam_hdr,
-                                    umi_opts opts,
-                                    samFile* out,
-                                    Fun fun) {
-  auto cur_ref = 0;
-  auto last_ref = -1;
-  int64_t last_pos = 0l;
-  int64_t last_output_pos = 0l;
-
-  robin_hood::unordered_flat_map<
-      int64_t,
-      robin_hood::unordered_flat_map<
-          ReadGroup,
-          robin_hood::unordered_flat_map<
-              std::string,
-              std::pair<std::unique_ptr<bam1_t, bam1_t_deleter>, uint64_t>>>>
-      read_map;
-  robin_hood::unordered_flat_map<
-      int64_t,
-      robin_hood::unordered_flat_map<
-          ReadGroup, robin_hood::unordered_flat_map<std::string, uint64_t>>>
-      read_counts;
-
-  robin_hood::unordered_set<bam1_t*, custom_bam1_hash, custom_bam1_eq>
-      current_reads;
-
-  robin_hood::unordered_flat_set<std::unique_ptr<bam1_t, bam1_t_deleter>,
-                                 custom_bam1_hash, custom_bam1_eq>
-      not_yet_paired_reads;
-  robin_hood::unordered_flat_set<std::unique_ptr<bam1_t, bam1_t_deleter>,
-                                 custom_bam1_hash, custom_bam1_eq>
-      paired_read_map;
-
-  auto output_positions = [&read_map, &read_counts, &fun, &current_reads,
-                           &paired_read_map, &not_yet_paired_reads](
-                              nonstd::optional<int64_t> start,
-                              int32_t bam_pos) {
-    std::vector<int64_t> positions;
-    positions.reserve(read_map.size());
-    for (auto& k_v : read_map) {
-      if (!start.has_value() || k_v.first + 1000 < start) {
-        positions.push_back(k_v.first);
-      }
-    }
-    std::sort(positions.begin(), positions.end());
-    for (auto p : positions) {
-      auto& map_p = read_map[p];
-      std::vector<ReadGroup> sorted_keys;
-      sorted_keys.reserve(map_p.size());
-      for (auto& k_v : read_map[p]) {
-        sorted_keys.push_back(k_v.first);
-      }
-      std::sort(sorted_keys.begin(), sorted_keys.end());
-      for (auto& k : sorted_keys) {
-        if (is_paired) {
-          for (auto& e : map_p[k]) {
-            current_reads.erase(e.second.first.get());
-          }
-        }
-        fun(map_p[k], bam_pos, paired_read_map, not_yet_paired_reads);
-      }
+/**
+ * Key of a UMI group. The hash is computed once when the key is made, such
+ * that it can be computed ahead of the table update, e.g. on another thread.
+ */
+template <class ReadGroup>
+struct dedup_key {
+  int64_t pos = 0;
+  ReadGroup group{};
+  umi_key umi;
+  std::size_t hash = 0;
+};
+
+template <class ReadGroup>
+dedup_key<ReadGroup> make_dedup_key(int64_t pos,
+                                    const ReadGroup& group,
+                                    const umi_key& umi) {
+  auto hash = robin_hood::hash_int(static_cast<uint64_t>(pos) * 31u +
+                                   std::hash<ReadGroup>()(group)) ^
+              umi.hash();
+  return {pos, group, umi, hash};
+}
+
+template <class ReadGroup>
+bool operator==(const dedup_key<ReadGroup>& lhs,
+                const dedup_key<ReadGroup>& rhs) {
+  return lhs.hash == rhs.hash && lhs.pos == rhs.pos &&
+         lhs.group == rhs.group && lhs.umi == rhs.umi;
+}
+
+struct dedup_key_hash {
+  template <class ReadGroup>
+  std::size_t operator()(const dedup_key<ReadGroup>& lhs) const {
+    return lhs.hash;
+  }
+};
+
+/**
+ * Representative read of a UMI group and the number of reads in the group.
+ */
+struct dedup_entry {
+  pooled_bam1_ptr read;
+  uint64_t count = 0;
+  // only set for paired reads
+  mate_key key{};
+};
+
+/**
+ * Ring buffer of values per position, indexed by the offset from the lowest
+ * position that has not been flushed yet. Grows if a position does not fit
+ * into the current window.
+ */
+template <class Value>
+class position_ring {
+ public:
+  std::vector<Value>& operator[](int64_t pos) {
+    if (span_ == 0) {
+      base_ = pos;
+      head_ = 0;
     }
-    for (auto p : positions) {
-      read_map.erase(p);
-      read_counts.erase(p);
+    if (pos < base_) {
+      reserve(span_ + static_cast<std::size_t>(base_ - pos));
+      head_ = (head_ - static_cast<std::size_t>(base_ - pos)) & mask_;
+      span_ += static_cast<std::size_t>(base_ - pos);
+      base_ = pos;
+    } else if (static_cast<std::size_t>(pos - base_) >= span_) {
+      reserve(static_cast<std::size_t>(pos - base_) + 1);
+      span_ = static_cast<std::size_t>(pos - base_) + 1;
     }
-  };
+    auto& slot = slots_[(head_ + static_cast<std::size_t>(pos - base_)) & mask_];
+    if (slot.empty()) {
+      ++used_slots_;
+    }
+    return slot;
+  }
 
-  cpg::cpg_cfg prog_cfg{};
-  prog_cfg.unit = "aln";
-  prog_cfg.unit_scale = true;
-  prog_cfg.mininterval = 3;
-  prog_cfg.desc = "Dedup UMIs";
+  /** Bytes of the slots, without the values stored in them. */
+  uint64_t bytes() const {
+    return slots_.capacity() * sizeof(std::vector<Value>);
+  }
 
-  auto progress = cpg::cpg(prog_cfg);
+  /** Prefetches the slot of pos if it lies within the current window. */
+  void prefetch(int64_t pos) const {
+    if (span_ > 0 && pos >= base_ &&
+        static_cast<std::size_t>(pos - base_) < span_) {
+      __builtin_prefetch(
+          &slots_[(head_ + static_cast<std::size_t>(pos - base_)) & mask_]);
+    }
+  }
 
-  UMI_FORMAT umi_fmt = UMI_FORMAT::UNKNOWN;
-  bam1_t* record = bam_init1();
-  while (sam_read1(file, bam_hdr, record) > 0) {
-    if ((record->core.flag & BAM_FUNMAP) == 0) {
-      if (is_paired && (record->core.flag & BAM_FMUNMAP) != 0 &&
-          opts.unpaired_reads == "discard") {
-        progress.update();
-        continue;
-      }
-      if (is_paired && (record->core.flag & BAM_FREAD2) != 0) {
-        if (record->core.tid <= cur_ref) {
-          // we already saw r1
-          if (record->core.mpos < record->core.pos ||
-              record->core.tid < cur_ref) {
-            bam1_t dummy = build_mate_bam1_dummy(*record);
-            // keep paired read only if we kept r1
-            if (current_reads.find(&dummy) != current_reads.end()) {
-              paired_read_map.emplace(bam_dup1(record));
-            } else {
-              // maybe r1 is from a previous bundle
-              std::unique_ptr<bam1_t, bam1_t_deleter> dummy_ptr(&dummy);
-              auto it = not_yet_paired_reads.find(dummy_ptr);
-              if (it != not_yet_paired_reads.end()) {
-                // output directly
-                if (sam_write1(out, bam_hdr, it->get()) < 0) {
-                  std::cerr << "Failed to write to output file!" << std::endl;
-                  std::exit(1);
-                }
-                if (sam_write1(out, bam_hdr, record) < 0) {
-                  std::cerr << "Failed to write to output file!" << std::endl;
-                  std::exit(1);
-                }
-                not_yet_paired_reads.erase(it);
-              }
-              // this is not a pointer to the free store, so release ownership
-              dummy_ptr.release();
-              progress.update();
-              continue;
-            }
-          } else {  // >= 0, need to check later
-            paired_read_map.emplace(bam_dup1(record));
-          }
-        } else {
-          paired_read_map.emplace(bam_dup1(record));
-        }
-        progress.update();
-        continue;
-      }
-      cur_ref = record->core.tid;
-      auto* qname = bam_get_qname(record);
-      if (umi_fmt == UMI_FORMAT::UNKNOWN) {
-        umi_fmt = determine_umi_format(qname, std::strlen(qname));
-      }
-      auto umi = get_umi(qname, std::strlen(qname), umi_fmt);
-      int64_t start = 0;
-      int64_t pos = 0;
-      bool is_spliced = false;
-      std::tie(start, pos, is_spliced) =
-          get_read_position(record, opts.soft_clip_threshold);
-
-      if (is_paired && (record->core.flag & BAM_FPAIRED) != 0 &&
-          record->core.tid != record->core.mtid) {
-        // chimeric read pair
-        // other possibility is "use", which is implicitly handled
-        if (opts.chimeric_pairs == "discard") {
-          bam1_t dummy = build_mate_bam1_dummy(*record);
-          std::unique_ptr<bam1_t, bam1_t_deleter> dummy_ptr(&dummy);
-          paired_read_map.erase(dummy_ptr);
-          dummy_ptr.release();
-          progress.update();
-          continue;
-        }
+  /**
+   * Passes all non-empty positions before max_pos to fun in ascending order
+   * and removes them.
+   */
+  template <class Fun>
+  void flush(int64_t max_pos, Fun fun) {
+    while (span_ > 0 && base_ < max_pos) {
+      if (used_slots_ == 0) {
+        span_ = 0;
+        break;
       }
-
-      // new ref, so output all previous reads
-      if (cur_ref != last_ref) {
-        output_positions(nonstd::nullopt, std::numeric_limits<int32_t>::max());
-        last_output_pos = 0;
-      } else if (last_output_pos + 1000 < start) {
-        output_positions(start, record->core.pos);
-        last_output_pos = start;
+      auto& slot = slots_[head_];
+      if (!slot.empty()) {
+        fun(base_, slot);
+        // keeps the capacity, so the slot can be reused without allocating
+        slot.clear();
+        --used_slots_;
       }
+      head_ = (head_ + 1) & mask_;
+      ++base_;
+      --span_;
+    }
+  }
 
-      last_pos = std::max(pos, start);
-      last_ref = cur_ref;
-      auto key = ReadGroup(
-          bam_is_rev(record), opts.spliced && is_spliced != 0,
-          (!opts.ignore_tlen && opts.paired) ? record->core.isize : 0,
-          static_cast<uint16_t>(opts.read_length ? record->core.l_qseq : 0));
-      update_read_map<ReadGroup, is_paired>(record, pos, key, std::string{umi},
-                                            read_map, read_counts,
-                                            paired_read_map, current_reads);
+ private:
+  void reserve(std::size_t span) {
+    if (span <= slots_.size()) {
+      return;
+    }
+    auto capacity = std::max<std::size_t>(slots_.size(), 1024);
+    while (capacity < span) {
+      capacity *= 2;
+    }
+    std::vector<std::vector<Value>> slots(capacity);
+    for (auto i = 0ul; i < span_; ++i) {
+      slots[i] = std::move(slots_[(head_ + i) & mask_]);
     }
-    progress.update();
+    slots_ = std::move(slots);
+    mask_ = capacity - 1;
+    head_ = 0;
   }
-  output_positions(nonstd::nullopt, std::numeric_limits<int32_t>::max());
-  if (is_paired && SHOW_DEBUG_OUTPUT && !not_yet_paired_reads.empty()) {
-    std::cerr << not_yet_paired_reads << std::endl;
+
+  std::vector<std::vector<Value>> slots_;
+  std::size_t mask_ = 0;
+  std::size_t head_ = 0;
+  std::size_t span_ = 0;
+  std::size_t used_slots_ = 0;
+  int64_t base_ = 0;
+};
+
+/**
+ * Open addressing hash table with linear probing, whose keys carry their
+ * precomputed hash. Unlike the robin_hood tables it exposes the slot a hash
+ * maps to, such that the slot can be prefetched before the key is looked up.
+ * References to values are invalidated by inserting.
+ */
+template <class Key, class Value>
+class prefetchable_map {
+ public:
+  bool empty() const { return size_ == 0; }
+  std::size_t size() const { return size_; }
+
+  /** Bytes of the slots, without memory owned by the values. */
+  uint64_t bytes() const { return slots_.capacity() * sizeof(slot); }
+
+  /** Hints that a key with the given hash is about to be looked up. */
+  void prefetch(std::size_t hash) const {
+    if (!slots_.empty()) {
+      __builtin_prefetch(&slots_[hash & mask_]);
+    }
   }
-  if (is_paired && opts.unpaired_reads == "use") {
-    for (auto& read : not_yet_paired_reads) {
-      if (sam_write1(out, bam_hdr, read.get()) < 0) {
-        std::cerr << "Failed to write to output file!" << std::endl;
-        std::exit(1);
+
+  /** Returns the value of key, inserting a default value if it is new. */
+  Value& operator[](const Key& key) {
+    if ((size_ + 1) * 4 > slots_.size() * 3) {
+      grow();
+    }
+    auto i = key.hash & mask_;
+    while (slots_[i].used) {
+      if (slots_[i].key == key) {
+        return slots_[i].value;
       }
+      i = (i + 1) & mask_;
     }
+    slots_[i].used = true;
+    slots_[i].key = key;
+    ++size_;
+    return slots_[i].value;
   }
-  bam_destroy1(record);
-}
 
-template <class Fun>
-void process_bam_read_chunks(samFile* file,
-                             bam_hdr_t* bam_hdr,
-                             umi_opts opts,
-                             samFile* out,
-                             Fun fun) {
-  if (opts.paired) {
-    process_bam_read_chunks_helper<read_group_paired, true>(file, bam_hdr, opts,
-                                                            out, fun);
-  } else {
-    process_bam_read_chunks_helper<read_group, false>(file, bam_hdr, opts, out,
-                                                      fun);
+  /**
+   * Moves the value of key, which has to be in the map, to res and removes
+   * the key.
+   */
+  void extract(const Key& key, Value& res) {
+    auto i = key.hash & mask_;
+    while (!(slots_[i].key == key)) {
+      i = (i + 1) & mask_;
+    }
+    res = std::move(slots_[i].value);
+    erase_slot(i);
   }
-}
 
-template <class Fun>
-void process_paired_reads(
-    std::unique_ptr<bam1_t, bam1_t_deleter>& r1,
-    robin_hood::unordered_flat_set<std::unique_ptr<bam1_t, bam1_t_deleter>,
-                                   custom_bam1_hash,
-                                   custom_bam1_eq>& paired_reads,
-    robin_hood::unordered_flat_set<std::unique_ptr<bam1_t, bam1_t_deleter>,
-                                   custom_bam1_hash,
-                                   custom_bam1_eq>& not_yet_paired_reads,
-    int32_t bam_pos,
-    Fun fun) {
-  if ((r1->core.flag & BAM_FMUNMAP) == 0) {  // has mate
-    if (r1->core.mpos <= bam_pos) {  // we can only have the mate if it was
-                                     // before our current position
-      bam1_t dummy = build_mate_bam1_dummy(*r1);
-      std::unique_ptr<bam1_t, bam1_t_deleter> dummy_ptr(&dummy);
-      auto it = paired_reads.find(dummy_ptr);
-      dummy_ptr.release();
-      if (it != paired_reads.end()) {
-        fun(r1.get());
-        fun(it->get());
-        paired_reads.erase(it);
-      } else {
-        not_yet_paired_reads.insert(std::move(r1));
+ private:
+  struct slot {
+    Key key{};
+    Value value{};
+    bool used = false;
+  };
+
+  /**
+   * Frees slot i and shifts the following keys of the probe sequence back,
+   * such that no key is separated from its home slot by a free slot.
+   */
+  void erase_slot(std::size_t i) {
+    for (auto j = (i + 1) & mask_; slots_[j].used; j = (j + 1) & mask_) {
+      auto home = slots_[j].key.hash & mask_;
+      // keys whose home lies cyclically in (i, j] are still reachable
+      auto stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+      if (!stays) {
+        slots_[i].key = slots_[j].key;
+        slots_[i].value = std::move(slots_[j].value);
+        i = j;
       }
-    } else {
-      not_yet_paired_reads.insert(std::move(r1));
     }
-  } else {
-    fun(r1.get());
+    slots_[i].used = false;
+    slots_[i].value = Value{};
+    --size_;
   }
-}
 
-void dedup(const std::string& input, const std::string& output, umi_opts opts) {
-  rand_gen.seed(opts.seed);
+  void grow() {
+    std::vector<slot> old(std::max<std::size_t>(slots_.size() * 2, 1024));
+    old.swap(slots_);
+    mask_ = slots_.size() - 1;
+    for (auto& s : old) {
+      if (s.used) {
+        auto i = s.key.hash & mask_;
+        while (slots_[i].used) {
+          i = (i + 1) & mask_;
+        }
+        slots_[i].used = true;
+        slots_[i].key = s.key;
+        slots_[i].value = std::move(s.value);
+      }
+    }
+  }
 
-  samFile* file = hts_open(input.c_str(), "r");
+  std::vector<slot> slots_;
+  std::size_t mask_ = 0;
+  std::size_t size_ = 0;
+};
 
-  if (file == nullptr) {
-    throw std::runtime_error(fmt::format("Could not open file '{}'", input));
+/**
+ * Single hash table holding the state of all UMI groups, keyed by position,
+ * read group and UMI. The groups of each position are kept in a ring buffer
+ * of positions, which determines the output order.
+ */
+template <class ReadGroup>
+class dedup_table {
+ public:
+  /**
+   * Returns the entry of the given group, inserting an empty entry if the
+   * group is new.
+   */
+  dedup_entry& operator[](const dedup_key<ReadGroup>& key) {
+    auto& entry = entries_[key];
+    if (entry.read == nullptr) {
+      positions_[key.pos].push_back(key);
+    }
+    return entry;
   }
 
-  if (opts.ithreads > 1) {
-    hts_set_threads(file, opts.ithreads);
+  bool empty() const { return entries_.empty(); }
+
+  /**
+   * Moves the given groups of pos in front of its other groups, keeping
+   * their order. Groups merged back from disk have been added to pos before
+   * the groups added since, so this restores the order of the groups.
+   */
+  void put_first(int64_t pos, const std::vector<dedup_key<ReadGroup>>& keys) {
+    auto& slot = positions_[pos];
+    robin_hood::unordered_flat_set<dedup_key<ReadGroup>, dedup_key_hash> first;
+    std::vector<dedup_key<ReadGroup>> res;
+    res.reserve(slot.size());
+    for (auto& key : keys) {
+      if (first.insert(key).second) {
+        res.push_back(key);
+      }
+    }
+    for (auto& key : slot) {
+      if (first.count(key) == 0) {
+        res.push_back(key);
+      }
+    }
+    slot = std::move(res);
   }
 
-  // read header
-  bam_hdr_t* bam_hdr = sam_hdr_read(file);
+  /** Bytes of the table, without the records of the groups. */
+  uint64_t bytes() const {
+    return entries_.bytes() +
+           entries_.size() * sizeof(dedup_key<ReadGroup>) + positions_.bytes();
+  }
 
-  // require sorted bam file
-  if ((bam_hdr->l_text > 3) && (strncmp(bam_hdr->text, "@HD", 3) == 0)) {
-    auto* p = strstr(bam_hdr->text, "\tSO:coordinate");
-    auto* q = strchr(bam_hdr->text, '\n');
-    // Looking for SO:coordinate within the @HD line only
-    // (e.g. must ignore in a @CO comment line later in header)
-    if ((p == nullptr) || (p >= q)) {
-      throw std::runtime_error(
-          fmt::format("BAM file needs to be coordinate sorted!"));
-    }
-  } else {
-    throw std::runtime_error(
-        fmt::format("BAM file needs to be coordinate sorted!"));
+  /**
+   * Hints that the given key is about to be looked up, prefetching the slot
+   * its precomputed hash maps to and the slot of its position.
+   */
+  void prefetch(const dedup_key<ReadGroup>& key) const {
+    entries_.prefetch(key.hash);
+    positions_.prefetch(key.pos);
   }
 
-  samFile* out = hts_open(output.c_str(), opts.uncompressed           ? "wbu"
-                                          : ends_with(output, ".bam") ? "wb"
-                                                                      : "w");
-  if (out == nullptr) {
-    throw std::runtime_error(fmt::format("Could not open file '{}'", output));
+  /**
+   * Passes the bundles of all positions before max_pos to fun, ordered by
+   * position and read group, and removes them from the table.
+   */
+  template <class Fun>
+  void flush(int64_t max_pos, Fun fun) {
+    positions_.flush(max_pos, [this, &fun](int64_t /*pos*/, auto& groups) {
+      std::stable_sort(groups.begin(), groups.end(),
+                       [](const auto& lhs, const auto& rhs) {
+                         return lhs.group < rhs.group;
+                       });
+      for (auto group_it = groups.begin(); group_it != groups.end();) {
+        bundle_.clear();
+        auto& group = group_it->group;
+        for (; group_it != groups.end() && group_it->group == group;
+             ++group_it) {
+          entries_.extract(*group_it, entry_);
+          bundle_.push_back({group_it->umi, std::move(entry_.read),
+                             entry_.count, entry_.key});
+        }
+        fun(bundle_);
+      }
+    });
   }
 
-  if (opts.othreads > 1) {
-    hts_set_threads(out, opts.othreads);
+ private:
+  prefetchable_map<dedup_key<ReadGroup>, dedup_entry> entries_;
+  position_ring<dedup_key<ReadGroup>> positions_;
+  umi_bundle bundle_;
+  dedup_entry entry_;
+};
+
+template <class MateMap>
+void erase_mate(MateMap& mates, const mate_key& key) {
+  mates.erase(mate_of(key));
+}
+
+void write_record(samFile* out, const bam_hdr_t* bam_hdr, const bam1_t* read) {
+  if (sam_write1(out, bam_hdr, read) < 0) {
+    std::cerr << "Failed to write to output file!" << std::endl;
+    std::exit(1);
   }
+}
 
-  if (sam_hdr_write(out, bam_hdr) < -1) {
-    throw std::runtime_error(
-        fmt::format("Could not write header to file '{}'", output));
+/**
+ * Destination of the deduplicated reads: the output file, or a name sorter
+ * if the flags are fixed in the same process.
+ */
+class record_writer {
+ public:
+  record_writer(samFile* out, const bam_hdr_t* bam_hdr, name_sorter* sorter)
+      : out_(out), bam_hdr_(bam_hdr), sorter_(sorter) {}
+
+  void operator()(const bam1_t* read) {
+    if (sorter_ != nullptr) {
+      sorter_->add(read);
+    } else {
+      write_record(out_, bam_hdr_, read);
+    }
   }
 
-  umi_clusterer clusterer(opts.method);
-
-  process_bam_read_chunks(
-      file, bam_hdr, opts, out,
-      [&clusterer, &out, &bam_hdr, paired = opts.paired](
-          auto& bundle, auto bam_pos, auto& paired_read_map,
-          auto& not_yet_paired_reads) {
-        clusterer(bundle, [&out, &bam_hdr, &paired_read_map,
-                           &not_yet_paired_reads, &bam_pos,
-                           paired](auto& read, auto& /*umi*/, auto& /*count*/) {
-          if (paired) {
-            process_paired_reads(
-                read, paired_read_map, not_yet_paired_reads, bam_pos,
-                [&out, &bam_hdr](const bam1_t* r) {
-                  if (sam_write1(out, bam_hdr, r) < 0) {
-                    std::cerr << "Failed to write to output file!" << std::endl;
-                    std::exit(1);
-                  }
-                });
-          } else {
-            if (sam_write1(out, bam_hdr, read.get()) < 0) {
-              std::cerr << "Failed to write to output file!" << std::endl;
-              std::exit(1);
-            }
-          }
-        });
-      });
+ private:
+  samFile* out_;
+  const bam_hdr_t* bam_hdr_;
+  name_sorter* sorter_;
+};
+
+uint64_t splitmix64(uint64_t x) {
+  x += 0x9E3779B97F4A7C15ull;
+  x = (x ^ (x >> 30u)) * 0xBF58476D1CE4E5B9ull;
+  x = (x ^ (x >> 27u)) * 0x94D049BB133111EBull;
+  return x ^ (x >> 31u);
+}
+
+/**
+ * Random number of a read derived from the seed and the identity of the read
+ * only. Equally good duplicates are chosen by the highest priority, so the
+ * choice does not depend on the order in which reads are processed.
+ */
+uint64_t read_priority(uint64_t seed, const bam1_t& read) {
+  auto qname_hash = robin_hood::hash_bytes(bam_get_qname(&read),
+                                           std::strlen(bam_get_qname(&read)));
+  auto pos = static_cast<uint64_t>(static_cast<uint32_t>(read.core.tid))
+                 << 32u |
+             static_cast<uint32_t>(read.core.pos);
+  auto res = splitmix64(seed ^ qname_hash);
+  res = splitmix64(res ^ pos);
+  return splitmix64(res ^ read.core.flag);
+}
+
+/**
+ * Adds read to its UMI group, as the kept read of count reads. duplicate is
+ * called with every read that is not kept, including the waiting mates of
+ * dropped first reads.
+ */
+template <class ReadGroup, bool is_paired, class Duplicate>
+void update_read_map(
+    bam1_t* read,
+    const mate_key& read_key,
+    const dedup_key<ReadGroup>& key,
+    uint64_t count,
+    dedup_table<ReadGroup>& table,
+    record_pool& pool,
+    pooled_mate_map& paired_read_map,
+    mate_key_set& current_reads,
+    uint64_t seed,
+    Duplicate duplicate) {
+  auto drop_mate = [&paired_read_map, &duplicate](const mate_key& key) {
+    auto it = paired_read_map.find(mate_of(key));
+    if (it != paired_read_map.end()) {
+      duplicate(it->second.get());
+      paired_read_map.erase(it);
+    }
+  };
+  auto& res = table[key];
+  if (res.read == nullptr) {
+    res.read = pooled_copy(pool, read);
+    if (is_paired) {
+      res.key = read_key;
+      current_reads.insert(read_key);
+    }
+    res.count = count;
+    return;
+  }
+  res.count += count;
+  auto read_qual = read->core.qual;
+  auto other_qual = res.read->core.qual;
+  bool replace = false;
+  if (read_qual > other_qual) {
+    replace = true;
+  } else if (read_qual == other_qual) {
+    replace = read_priority(seed, *read) > read_priority(seed, *res.read);
+  }
+  if (replace) {
+    // replace with other read, so remove paired
+    if (is_paired && read_is_potentially_after_mate(*res.read)) {
+      drop_mate(res.key);
+    }
+    if (is_paired) {
+      current_reads.erase(res.key);
+    }
+    duplicate(res.read.get());
+    res.read = pooled_copy(pool, read);
+    if (is_paired) {
+      res.key = read_key;
+      current_reads.insert(read_key);
+    }
+  } else {
+    if (is_paired && read_is_potentially_after_mate(*read)) {
+      // bad qual so drop pair
+      drop_mate(read_key);
+    }
+    duplicate(read);
+  }
+}
+
+std::ostream& operator<<(std::ostream& out, const umi_bundle& lhs) {
+  out << '{';
+  for (auto& el : lhs) {
+    out << el.umi << ' ';
+  }
+  out << '}';
+  return out;
+}
+
+template <class Ptr>
+std::ostream& operator<<(std::ostream& out, const mate_map_t<Ptr>& lhs) {
+  out << '{';
+  for (auto& e : lhs) {
+    out << bam_get_qname(e.second) << '|' << e.second->core.pos << ",\n";
+  }
+  out << '}';
+  return out;
+}
+
+/**
+ * Genomic interval that is deduplicated independently of all other regions.
+ * A region owns all reads starting in [beg, end) on reference tid.
+ */
+struct dedup_region {
+  int32_t tid;
+  int32_t beg;
+  int32_t end;
+
+  bool contains_mate(const bam1_t& read) const {
+    return read.core.mtid == tid && read.core.mpos >= beg &&
+           read.core.mpos < end;
+  }
+};
+
+dedup_region whole_reference(int32_t tid) {
+  return {tid, 0, std::numeric_limits<int32_t>::max()};
+}
+
+constexpr std::size_t batch_size = 4096;
+// reads added between two reports to the memory governor
+constexpr uint64_t memory_check_interval = 1024;
+
+/** Bytes retained by the state of a deduplicator, by structure. */
+struct memory_usage {
+  // UMI groups with their kept reads
+  uint64_t groups = 0;
+  // keys of the kept first reads
+  uint64_t kept_keys = 0;
+  // second reads waiting for the decision on their first read
+  uint64_t waiting_mates = 0;
+  // kept first reads waiting for their mate
+  uint64_t unpaired = 0;
+  // records kept for reuse
+  uint64_t free_records = 0;
+  // reads whose mate is handled elsewhere, buffered by the orphan store
+  uint64_t orphans = 0;
+  // coordinate ordered output that is held back
+  uint64_t reorder = 0;
+};
+
+enum class memory_action {
+  FREE_RECORDS,
+  SPILL_UNPAIRED,
+  SPILL_ORPHANS,
+  SPILL_GROUPS
+};
+
+/**
+ * Accounts the memory retained by the dedup state of all threads against a
+ * limit. Deduplicators and the orphan store report their retained bytes from
+ * time to time, and degrade while the total is over the limit: they free the
+ * records kept for reuse, spill reads waiting for their mate to disk and
+ * spill the UMI groups of the flush window to disk. The first time each of
+ * these happens, the structures of the reporter are logged.
+ */
+class memory_governor {
+ public:
+  explicit memory_governor(uint64_t max_bytes) : max_bytes_(max_bytes) {}
+
+  bool enabled() const { return max_bytes_ != 0; }
+
+  /**
+   * Replaces the previous report of a reporter, which is kept in reported.
+   * Returns true if the total is over the limit.
+   */
+  bool report(uint64_t& reported, uint64_t bytes) {
+    auto total = (total_ += bytes - reported);
+    reported = bytes;
+    auto peak = peak_.load();
+    while (total > peak && !peak_.compare_exchange_weak(peak, total)) {
+    }
+    return enabled() && total > max_bytes_;
+  }
+
+  /** Counts an action taken to stay within the limit. */
+  void degrade(memory_action action, const memory_usage& usage) {
+    auto& count = actions_[static_cast<std::size_t>(action)];
+    if (count++ != 0) {
+      return;
+    }
+    auto mb = [](uint64_t bytes) { return static_cast<double>(bytes) / 1e6; };
+    std::lock_guard<std::mutex> lock(log_mutex_);
+    std::cerr << fmt::format(
+                     "Memory limit of {:.1f} MB reached ({:.1f} MB retained), "
+                     "{}. Retained by the reporting thread: UMI groups {:.1f} "
+                     "MB, kept read keys {:.1f} MB, waiting second reads "
+                     "{:.1f} MB, first reads waiting for their mate {:.1f} "
+                     "MB, records kept for reuse {:.1f} MB, orphan reads "
+                     "{:.1f} MB, held back output {:.1f} MB.",
+                     mb(max_bytes_), mb(total_.load()), description(action),
+                     mb(usage.groups), mb(usage.kept_keys),
+                     mb(usage.waiting_mates), mb(usage.unpaired),
+                     mb(usage.free_records), mb(usage.orphans),
+                     mb(usage.reorder))
+              << std::endl;
+  }
+
+  /** Logs how often the limit has been enforced. */
+  void summary() const {
+    if (!enabled()) {
+      return;
+    }
+    std::string actions;
+    for (auto i = 0ul; i < actions_.size(); ++i) {
+      if (actions_[i] > 0) {
+        actions += fmt::format("{}{} {} times", actions.empty() ? "" : ", ",
+                               description(static_cast<memory_action>(i)),
+                               actions_[i].load());
+      }
+    }
+    std::cerr << fmt::format(
+                     "Peak dedup memory: {:.1f} MB of {:.1f} MB{}{}",
+                     static_cast<double>(peak_.load()) / 1e6,
+                     static_cast<double>(max_bytes_) / 1e6,
+                     actions.empty() ? "" : ", ", actions)
+              << std::endl;
+  }
+
+ private:
+  static const char* description(memory_action action) {
+    switch (action) {
+      case memory_action::FREE_RECORDS:
+        return "freeing records kept for reuse";
+      case memory_action::SPILL_UNPAIRED:
+        return "handing first reads waiting for their mate to the orphan "
+               "store";
+      case memory_action::SPILL_ORPHANS:
+        return "spilling orphan reads to disk";
+      case memory_action::SPILL_GROUPS:
+        return "spilling UMI groups to disk";
+    }
+    return "";
+  }
+
+  uint64_t max_bytes_;
+  std::atomic<uint64_t> total_{0};
+  std::atomic<uint64_t> peak_{0};
+  std::array<std::atomic<uint64_t>, 4> actions_{};
+  std::mutex log_mutex_;
+};
+
+/**
+ * What the thread writing the output does with a read passed on by a
+ * deduplicator. Orphans, paired reads whose mate is deduplicated in another
+ * region or has been handed over to stay within the memory limit, are held
+ * by the orphan store until their mate joins them.
+ */
+enum class output_kind : uint8_t { WRITE, HOLD, JOIN };
+
+/**
+ * Orders the keys of the mates joining held reads by their position, i.e. in
+ * the order the mates are output.
+ */
+bool joins_before(const mate_key& lhs, const mate_key& rhs) {
+  return std::tie(lhs.tid, lhs.pos, lhs.qname_hash, lhs.mtid, lhs.mpos,
+                  lhs.isize, lhs.hi) < std::tie(rhs.tid, rhs.pos,
+                                                rhs.qname_hash, rhs.mtid,
+                                                rhs.mpos, rhs.isize, rhs.hi);
+}
+
+// numbers the temporary files of all orphan stores and deduplicators
+std::atomic<uint64_t> num_temporary_files{0};
+
+std::string temporary_file_path() {
+  return (ghc::filesystem::temp_directory_path() /
+          fmt::format("fumi_tools_{}_{}.tmp", ::getpid(),
+                      num_temporary_files++))
+      .string();
+}
+
+/**
+ * Held reads spilled to a temporary file, sorted by the position of the mate
+ * that joins them. head is the next read, key the key of its mate.
+ */
+class held_run {
+ public:
+  explicit held_run(std::string path) : path_(std::move(path)) {
+    file_ = bgzf_open(path_.c_str(), "r");
+    if (file_ == nullptr) {
+      throw std::runtime_error(
+          fmt::format("Could not open temporary file '{}'", path_));
+    }
+    read_next();
+  }
+
+  held_run(const held_run&) = delete;
+  held_run& operator=(const held_run&) = delete;
+
+  ~held_run() {
+    bgzf_close(file_);
+    std::remove(path_.c_str());
+  }
+
+  bool has_head() const { return head_ != nullptr; }
+
+  const mate_key& key() const { return key_; }
+
+  bam1_ptr take() {
+    auto res = std::move(head_);
+    read_next();
+    return res;
+  }
+
+ private:
+  void read_next() {
+    head_.reset(bam_init1());
+    auto ret = bam_read1(file_, head_.get());
+    if (ret < -1) {
+      throw std::runtime_error(
+          fmt::format("Could not read from temporary file '{}'", path_));
+    }
+    if (ret < 0) {
+      head_.reset();
+      return;
+    }
+    key_ = mate_of(make_mate_key(*head_));
+  }
+
+  std::string path_;
+  BGZF* file_;
+  bam1_ptr head_;
+  mate_key key_{};
+};
+
+/**
+ * Pairs the orphans in the order the output is written, such that a pair is
+ * written exactly where a single deduplicator of the whole file writes it:
+ * an orphan whose mate comes later is held, when the mate joins it, both are
+ * written, first read first. A second read is dropped if its first read is
+ * not held, i.e. has not been kept. Once more than max_bytes are held, or
+ * the dedup state is over its memory limit, the held reads are sorted by the
+ * position of their mate and spilled to temporary files, which are read
+ * back when the output reaches these positions. First reads that are never
+ * joined are written at the end if output_unpaired is set. Reads are only
+ * held and joined by the thread writing the output.
+ */
+class orphan_store {
+ public:
+  orphan_store(uint64_t max_bytes,
+               bool output_unpaired,
+               memory_governor& governor)
+      : max_bytes_(max_bytes),
+        output_unpaired_(output_unpaired),
+        governor_(governor) {}
+
+  orphan_store(const orphan_store&) = delete;
+  orphan_store& operator=(const orphan_store&) = delete;
+
+  ~orphan_store() {
+    if (unpaired_file_ != nullptr) {
+      bgzf_close(unpaired_file_);
+    }
+    if (!unpaired_path_.empty()) {
+      std::remove(unpaired_path_.c_str());
+    }
+  }
+
+  /** Keeps read until its mate joins it. */
+  void hold(const bam1_t& read) {
+    bytes_ += record_bytes(read);
+    if (!held_.emplace(mate_of(make_mate_key(read)), bam1_ptr(bam_dup1(&read)))
+             .second) {
+      bytes_ -= record_bytes(read);
+    }
+    if (++unchecked_reads_ == memory_check_interval) {
+      unchecked_reads_ = 0;
+      check_memory();
+    }
+  }
+
+  /**
+   * Writes read and its held mate to out. If the mate is not held, a first
+   * read is held in turn and a second read is dropped.
+   */
+  template <class Out>
+  void join(const bam1_t& read, Out& out) {
+    expire(read.core.tid);
+    restore(read.core.tid, read.core.pos);
+    auto it = held_.find(make_mate_key(read));
+    if (it == held_.end()) {
+      if ((read.core.flag & BAM_FREAD2) == 0) {
+        hold(read);
+      }
+      return;
+    }
+    if ((read.core.flag & BAM_FREAD2) != 0) {
+      out(it->second.get());
+      out(&read);
+    } else {
+      out(&read);
+      out(it->second.get());
+    }
+    bytes_ -= record_bytes(*it->second);
+    held_.erase(it);
+  }
+
+  /**
+   * Writes the first reads that have not been joined to out, if unpaired reads
+   * are output, in the order of the positions of their mates.
+   */
+  template <class Out>
+  void output(Out& out) {
+    if (unpaired_file_ != nullptr) {
+      bgzf_close(unpaired_file_);
+      unpaired_file_ = nullptr;
+      held_run unpaired(unpaired_path_);
+      unpaired_path_.clear();
+      while (unpaired.has_head()) {
+        out(unpaired.take().get());
+      }
+    }
+    take_until(std::numeric_limits<int32_t>::max(), [&](const bam1_t& read) {
+      if (output_unpaired_ && (read.core.flag & BAM_FREAD2) == 0) {
+        out(&read);
+      }
+    });
+    governor_.report(reported_bytes_, 0);
+  }
+
+  /**
+   * For coordinate ordered output: remembers the mate key of a kept first
+   * read whose mate lies on a later reference.
+   */
+  void add_kept_first_read(const mate_key& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    kept_first_reads_.insert(key);
+  }
+
+  /** Returns true if the first read of the second read key has been kept. */
+  bool take_kept_first_read(const mate_key& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return kept_first_reads_.erase(key) != 0;
+  }
+
+ private:
+  using held_read = std::pair<mate_key, bam1_ptr>;
+
+  /**
+   * Reads of references before tid are not joined anymore, the first reads
+   * among the held reads of their mates are kept for the end.
+   */
+  void expire(int32_t tid) {
+    if (tid <= tid_) {
+      return;
+    }
+    tid_ = tid;
+    take_until(tid, [this](const bam1_t& read) {
+      if (!output_unpaired_ || (read.core.flag & BAM_FREAD2) != 0) {
+        return;
+      }
+      if (unpaired_file_ == nullptr) {
+        unpaired_path_ = temporary_file_path();
+        unpaired_file_ = bgzf_open(unpaired_path_.c_str(), "wu");
+        if (unpaired_file_ == nullptr) {
+          throw std::runtime_error(fmt::format(
+              "Could not open temporary file '{}'", unpaired_path_));
+        }
+      }
+      if (bam_write1(unpaired_file_, &read) < 0) {
+        throw std::runtime_error(fmt::format(
+            "Could not write to temporary file '{}'", unpaired_path_));
+      }
+    });
+    governor_.report(reported_bytes_, retained_bytes());
+  }
+
+  /**
+   * Passes the held reads whose mate lies on a reference before tid to fun,
+   * ordered by the position of their mate, and removes them.
+   */
+  template <class Fun>
+  void take_until(int32_t tid, Fun fun) {
+    std::vector<held_read> reads;
+    for (auto it = held_.begin(); it != held_.end();) {
+      if (it->first.tid < tid) {
+        bytes_ -= record_bytes(*it->second);
+        reads.emplace_back(it->first, std::move(it->second));
+        it = held_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    sort_held_reads(reads);
+    auto next = reads.begin();
+    for (;;) {
+      const mate_key* min = next != reads.end() ? &next->first : nullptr;
+      held_run* min_run = nullptr;
+      for (auto& run : runs_) {
+        if (run->has_head() && run->key().tid < tid &&
+            (min == nullptr || joins_before(run->key(), *min))) {
+          min = &run->key();
+          min_run = run.get();
+        }
+      }
+      if (min == nullptr) {
+        break;
+      }
+      if (min_run != nullptr) {
+        fun(*min_run->take());
+      } else {
+        fun(*next->second);
+        ++next;
+      }
+    }
+    remove_finished_runs();
+  }
+
+  /** Reads the spilled reads whose mate lies at or before tid:pos back. */
+  void restore(int32_t tid, int32_t pos) {
+    if (std::tie(tid, pos) <= std::tie(restored_tid_, restored_pos_)) {
+      return;
+    }
+    restored_tid_ = tid;
+    restored_pos_ = pos;
+    auto restored = false;
+    for (auto& run : runs_) {
+      while (run->has_head() &&
+             std::tie(run->key().tid, run->key().pos) <= std::tie(tid, pos)) {
+        auto key = run->key();
+        auto read = run->take();
+        auto bytes = record_bytes(*read);
+        if (held_.emplace(key, std::move(read)).second) {
+          bytes_ += bytes;
+        }
+        restored = true;
+      }
+    }
+    if (restored) {
+      remove_finished_runs();
+      governor_.report(reported_bytes_, retained_bytes());
+    }
+  }
+
+  void remove_finished_runs() {
+    runs_.erase(std::remove_if(runs_.begin(), runs_.end(),
+                               [](const std::unique_ptr<held_run>& run) {
+                                 return !run->has_head();
+                               }),
+                runs_.end());
+  }
+
+  void check_memory() {
+    if (bytes_ > max_bytes_) {
+      spill();
+    } else if (governor_.report(reported_bytes_, retained_bytes()) &&
+               bytes_ > 0) {
+      memory_usage usage;
+      usage.orphans = retained_bytes();
+      governor_.degrade(memory_action::SPILL_ORPHANS, usage);
+      spill();
+    }
+    governor_.report(reported_bytes_, retained_bytes());
+  }
+
+  /**
+   * Spills the held reads to a temporary file, except the ones whose mate
+   * has been reached already, which would be read back right away.
+   */
+  void spill() {
+    std::vector<held_read> reads;
+    for (auto it = held_.begin(); it != held_.end();) {
+      if (std::tie(it->first.tid, it->first.pos) >
+          std::tie(restored_tid_, restored_pos_)) {
+        bytes_ -= record_bytes(*it->second);
+        reads.emplace_back(it->first, std::move(it->second));
+        it = held_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    if (reads.empty()) {
+      return;
+    }
+    if (SHOW_DEBUG_OUTPUT) {
+      std::cerr << "Spilling " << reads.size() << " orphan reads to disk"
+                << std::endl;
+    }
+    sort_held_reads(reads);
+    auto path = temporary_file_path();
+    BGZF* file = bgzf_open(path.c_str(), "wu");
+    if (file == nullptr) {
+      throw std::runtime_error(
+          fmt::format("Could not open temporary file '{}'", path));
+    }
+    for (auto& read : reads) {
+      if (bam_write1(file, read.second.get()) < 0) {
+        bgzf_close(file);
+        std::remove(path.c_str());
+        throw std::runtime_error(
+            fmt::format("Could not write to temporary file '{}'", path));
+      }
+    }
+    bgzf_close(file);
+    runs_.push_back(std::make_unique<held_run>(path));
+  }
+
+  static void sort_held_reads(std::vector<held_read>& reads) {
+    std::sort(reads.begin(), reads.end(),
+              [](const held_read& lhs, const held_read& rhs) {
+                return joins_before(lhs.first, rhs.first);
+              });
+  }
+
+  uint64_t retained_bytes() const {
+    return bytes_ + table_bytes<mate_map::value_type>(held_.size()) +
+           table_bytes<mate_key>(kept_first_reads_.size());
+  }
+
+  std::mutex mutex_;
+  uint64_t max_bytes_;
+  bool output_unpaired_;
+  memory_governor& governor_;
+  uint64_t reported_bytes_ = 0;
+  uint64_t unchecked_reads_ = 0;
+  uint64_t bytes_ = 0;
+  // held reads by the key of the mate joining them
+  mate_map held_;
+  std::vector<std::unique_ptr<held_run>> runs_;
+  int32_t tid_ = -1;
+  int32_t restored_tid_ = -1;
+  int32_t restored_pos_ = -1;
+  std::string unpaired_path_;
+  BGZF* unpaired_file_ = nullptr;
+  mate_key_set kept_first_reads_;
+};
+
+/**
+ * Writes the output of the deduplicators in order and passes the orphans to
+ * the orphan store, which writes them once they are paired.
+ */
+class orphan_writer {
+ public:
+  orphan_writer(record_writer& writer, orphan_store& orphans)
+      : writer_(writer), orphans_(orphans) {}
+
+  void operator()(const bam1_t* read,
+                  output_kind kind = output_kind::WRITE) {
+    switch (kind) {
+      case output_kind::WRITE:
+        writer_(read);
+        break;
+      case output_kind::HOLD:
+        orphans_.hold(*read);
+        break;
+      case output_kind::JOIN:
+        orphans_.join(*read, writer_);
+        break;
+    }
+  }
+
+ private:
+  record_writer& writer_;
+  orphan_store& orphans_;
+};
+
+/**
+ * Options that are checked for every read. They are template parameters, so
+ * the per-read path of each combination is compiled without option checks.
+ * Paired and single end reads use different aliases below, which fix the
+ * flags that do not apply to them.
+ */
+template <bool Paired,
+          bool DiscardUnpaired,
+          bool DiscardChimeric,
+          bool TemplateLength,
+          bool ReadLength,
+          bool Spliced,
+          bool UmiTag>
+struct dedup_mode {
+  using read_group = typename std::conditional<Paired,
+                                               fumi_tools::read_group_paired,
+                                               fumi_tools::read_group>::type;
+  static constexpr bool is_paired = Paired;
+  static constexpr bool discard_unpaired = DiscardUnpaired;
+  static constexpr bool discard_chimeric = DiscardChimeric;
+  static constexpr bool template_length = TemplateLength;
+  static constexpr bool read_length = ReadLength;
+  static constexpr bool spliced = Spliced;
+  static constexpr bool umi_tag = UmiTag;
+};
+
+template <bool DiscardUnpaired,
+          bool DiscardChimeric,
+          bool TemplateLength,
+          bool Spliced,
+          bool UmiTag>
+using paired_mode = dedup_mode<true,
+                               DiscardUnpaired,
+                               DiscardChimeric,
+                               TemplateLength,
+                               false,
+                               Spliced,
+                               UmiTag>;
+
+template <bool ReadLength, bool Spliced, bool UmiTag>
+using single_end_mode =
+    dedup_mode<false, false, false, false, ReadLength, Spliced, UmiTag>;
+
+/**
+ * Turns the runtime flags into template arguments of Mode one after the
+ * other and calls fun with the resulting mode.
+ */
+template <template <bool...> class Mode, bool... Flags>
+struct mode_dispatcher {
+  template <class Fun>
+  static void call(Fun& fun) {
+    fun(Mode<Flags...>{});
+  }
+
+  template <class Fun, class... Rest>
+  static void call(Fun& fun, bool flag, Rest... rest) {
+    if (flag) {
+      mode_dispatcher<Mode, Flags..., true>::call(fun, rest...);
+    } else {
+      mode_dispatcher<Mode, Flags..., false>::call(fun, rest...);
+    }
+  }
+};
+
+/** Calls fun with the dedup_mode matching opts. */
+template <class Fun>
+void dispatch_mode(const umi_opts& opts, Fun fun) {
+  auto umi_tag = !opts.umi_tag.empty();
+  if (opts.paired) {
+    mode_dispatcher<paired_mode>::call(
+        fun, opts.unpaired_reads == READ_HANDLING::DISCARD,
+        opts.chimeric_pairs == READ_HANDLING::DISCARD, !opts.ignore_tlen,
+        opts.spliced, umi_tag);
+  } else {
+    mode_dispatcher<single_end_mode>::call(fun, opts.read_length,
+                                           opts.spliced, umi_tag);
+  }
+}
+
+/**
+ * Properties of a read that only depend on the read itself. They are
+ * extracted before the reads are added to a region_deduplicator, such that
+ * the extraction can run ahead on other threads.
+ */
+template <class ReadGroup>
+struct read_features {
+  int64_t start = 0;
+  dedup_key<ReadGroup> group_key;
+  // only set for paired reads
+  mate_key key{};
+};
+
+template <class Mode>
+class feature_extractor {
+ public:
+  using ReadGroup = typename Mode::read_group;
+  static constexpr bool is_paired = Mode::is_paired;
+
+  explicit feature_extractor(const umi_opts& opts) : opts_(opts) {}
+
+  void operator()(const bam1_t* record, read_features<ReadGroup>& res) {
+    if ((record->core.flag & BAM_FUNMAP) != 0 ||
+        (Mode::discard_unpaired && (record->core.flag & BAM_FMUNMAP) != 0)) {
+      return;
+    }
+    if (is_paired) {
+      res.key = make_mate_key(*record);
+      // second reads are only matched with their mate
+      if ((record->core.flag & BAM_FREAD2) != 0) {
+        return;
+      }
+    }
+    umi_key umi;
+    if (Mode::umi_tag) {
+      umi = parse_umi_tag(record, opts_.umi_tag.c_str());
+    } else {
+      auto qname = get_qname(record);
+      if (umi_fmt_ == UMI_FORMAT::UNKNOWN) {
+        umi_fmt_ = determine_umi_format(qname);
+      }
+      umi = parse_umi(qname, umi_fmt_);
+    }
+    int64_t pos = 0;
+    bool is_spliced = false;
+    std::tie(res.start, pos, is_spliced) =
+        get_read_position(record, opts_.soft_clip_threshold);
+    auto group = ReadGroup(
+        bam_is_rev(record), Mode::spliced && is_spliced,
+        Mode::template_length ? record->core.isize : 0,
+        static_cast<uint16_t>(Mode::read_length ? record->core.l_qseq : 0));
+    res.group_key = make_dedup_key(pos, group, umi);
+  }
+
+ private:
+  const umi_opts& opts_;
+  UMI_FORMAT umi_fmt_ = UMI_FORMAT::UNKNOWN;
+};
+
+/**
+ * Input records and their features. The pipeline passes them from the
+ * reading thread through a feature worker to the deduplicating thread.
+ */
+template <class ReadGroup>
+struct input_batch {
+  std::vector<bam1_ptr> records;
+  std::vector<read_features<ReadGroup>> features;
+  std::size_t size = 0;
+};
+
+// records read at a time by threads that also deduplicate them
+constexpr std::size_t read_batch_size = 64;
+// records whose table slots are prefetched before the first one is added
+constexpr std::size_t prefetch_window = 32;
+
+/**
+ * Reads up to read_batch_size records with read, which returns false at the
+ * end of the input, and extracts their features. Returns false if no record
+ * was left.
+ */
+template <class Mode, class Read>
+bool read_input_batch(input_batch<typename Mode::read_group>& batch,
+                      feature_extractor<Mode>& extract_features,
+                      Read read) {
+  batch.size = 0;
+  while (batch.size < read_batch_size) {
+    if (batch.records.size() == batch.size) {
+      batch.records.emplace_back(bam_init1());
+      batch.features.emplace_back();
+    }
+    auto* record = batch.records[batch.size].get();
+    if (!read(record)) {
+      break;
+    }
+    extract_features(record, batch.features[batch.size]);
+    ++batch.size;
+  }
+  return batch.size > 0;
+}
+
+// positions are output once the 5' start of the reads is this far past them
+constexpr int64_t flush_window = 1000;
+
+/**
+ * Deduplicates the reads of a single region. Reads have to be passed in
+ * coordinate order, kept reads are passed to the sink. Paired reads whose
+ * mate lies outside of the region, or has been handed over to stay within
+ * the memory limit, are passed to the sink as orphans: held if their mate
+ * comes later, joining it otherwise.
+ */
+template <class Mode, class Sink>
+class region_deduplicator {
+ public:
+  using ReadGroup = typename Mode::read_group;
+  static constexpr bool is_paired = Mode::is_paired;
+
+  region_deduplicator(const umi_opts& opts,
+                      const dedup_region& region,
+                      umi_clusterer& clusterer,
+                      record_pool& pool,
+                      orphan_store& orphans,
+                      memory_governor& governor,
+                      Sink sink)
+      : opts_(opts),
+        region_(region),
+        clusterer_(clusterer),
+        pool_(pool),
+        orphans_(orphans),
+        governor_(governor),
+        sink_(sink),
+        extract_features_(opts),
+        max_not_yet_paired_bytes_(opts.max_orphan_memory /
+                                  std::max(1ul, opts.threads)) {}
+
+  region_deduplicator(const region_deduplicator&) = delete;
+  region_deduplicator& operator=(const region_deduplicator&) = delete;
+
+  ~region_deduplicator() {
+    for (auto& run : group_runs_) {
+      bgzf_close(run.file);
+      std::remove(run.path.c_str());
+    }
+  }
+
+  const dedup_region& region() const { return region_; }
+
+  /** Smallest position of the kept reads spilled to disk, max() if none. */
+  int32_t min_spilled_position() const { return spilled_positions_.min(); }
+
+  /** Hints that record is about to be added. */
+  void prefetch(const bam1_t* record,
+                const read_features<ReadGroup>& features) const {
+    __builtin_prefetch(record->data);
+    table_.prefetch(features.group_key);
+  }
+
+  /**
+   * Adds the first n records in order. Each window of records is prefetched
+   * before it is added, such that the cache misses of a window overlap.
+   */
+  void add(const std::vector<bam1_ptr>& records,
+           const std::vector<read_features<ReadGroup>>& features,
+           std::size_t n) {
+    for (auto beg = 0ul; beg < n; beg += prefetch_window) {
+      auto end = std::min(beg + prefetch_window, n);
+      for (auto i = beg; i < end; ++i) {
+        prefetch(records[i].get(), features[i]);
+      }
+      for (auto i = beg; i < end; ++i) {
+        add(records[i].get(), features[i]);
+      }
+    }
+  }
+
+  /** Adds a read whose features have already been extracted. */
+  void add(bam1_t* record, const read_features<ReadGroup>& features) {
+    add_read(record, features);
+    if (governor_.enabled() && ++unchecked_reads_ == memory_check_interval) {
+      unchecked_reads_ = 0;
+      check_memory();
+    }
+  }
+
+  /**
+   * For coordinate ordered output: drops second reads that wait for a first
+   * read at a position before pos which has not been grouped, e.g. because
+   * it is missing from the input. Otherwise they would hold back the output.
+   */
+  void purge_waiting_mates(int32_t pos) {
+    for (auto it = paired_read_map_.begin(); it != paired_read_map_.end();) {
+      if (it->second->core.mpos < pos &&
+          current_reads_.find(mate_of(it->first)) == current_reads_.end()) {
+        mark_duplicate(it->second.get());
+        it = paired_read_map_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  /**
+   * Outputs all remaining reads. First reads still waiting for their mate are
+   * held by the orphan store.
+   */
+  void finish() {
+    output_positions(nonstd::nullopt, std::numeric_limits<int32_t>::max());
+    move_not_yet_paired_reads();
+    spilled_first_reads_.clear();
+    kept_first_reads_.clear();
+    if (opts_.coordinate_order) {
+      purge_waiting_mates(std::numeric_limits<int32_t>::max());
+    }
+    paired_read_map_.clear();
+    governor_.report(reported_bytes_, 0);
+  }
+
+ private:
+  void add_read(bam1_t* record, const read_features<ReadGroup>& features) {
+    if ((record->core.flag & BAM_FUNMAP) != 0) {
+      return;
+    }
+    if (Mode::discard_unpaired && (record->core.flag & BAM_FMUNMAP) != 0) {
+      return;
+    }
+    if (is_paired && (record->core.flag & BAM_FREAD2) != 0) {
+      add_second_read(record, features.key);
+      return;
+    }
+    auto start = features.start;
+
+    if (Mode::discard_chimeric && (record->core.flag & BAM_FPAIRED) != 0 &&
+        record->core.tid != record->core.mtid) {
+      // chimeric read pair, chimeric pairs that are used need no handling
+      erase_mate(paired_read_map_, features.key);
+      return;
+    }
+
+    // the first read of a region never triggers an output
+    if (!has_reads_) {
+      has_reads_ = true;
+      // a region cut out of a reference starts right after all previous
+      // positions of the reference have been output
+      if (region_.beg > 0) {
+        last_output_pos_ = start;
+      }
+    } else if (last_output_pos_ + flush_window < start) {
+      output_positions(start, record->core.pos);
+      last_output_pos_ = start;
+    }
+
+    update_read_map<ReadGroup, is_paired>(
+        record, features.key, features.group_key, 1, table_, pool_,
+        paired_read_map_, current_reads_, opts_.seed,
+        [this](const bam1_t* read) { mark_duplicate(read); });
+  }
+
+  /** Bytes retained by the state of this region, including the pool. */
+  uint64_t retained_bytes() const {
+    return pool_.bytes() + pool_.free_bytes() + table_.bytes() +
+           table_bytes<mate_key>(current_reads_.size() +
+                                 spilled_first_reads_.size() +
+                                 kept_first_reads_.size()) +
+           table_bytes<pooled_mate_map::value_type>(
+               paired_read_map_.size() + not_yet_paired_reads_.size());
+  }
+
+  memory_usage usage() const {
+    memory_usage res;
+    for (auto& read : paired_read_map_) {
+      res.waiting_mates += record_bytes(*read.second);
+    }
+    res.waiting_mates +=
+        table_bytes<pooled_mate_map::value_type>(paired_read_map_.size());
+    res.unpaired = not_yet_paired_bytes_ +
+                   table_bytes<pooled_mate_map::value_type>(
+                       not_yet_paired_reads_.size());
+    res.kept_keys = table_bytes<mate_key>(current_reads_.size() +
+                                          spilled_first_reads_.size() +
+                                          kept_first_reads_.size());
+    res.free_records = pool_.free_bytes();
+    res.groups = retained_bytes() - res.waiting_mates - res.unpaired -
+                 res.kept_keys - res.free_records;
+    return res;
+  }
+
+  /**
+   * Reports the retained bytes to the memory governor. While they are over
+   * the limit, frees the records kept for reuse, hands the first reads
+   * waiting for their mate to the orphan store and spills the UMI groups to
+   * disk. The flush window is kept, so the groups do not change.
+   */
+  void check_memory() {
+    if (!governor_.report(reported_bytes_, retained_bytes())) {
+      return;
+    }
+    if (pool_.free_bytes() > 0) {
+      governor_.degrade(memory_action::FREE_RECORDS, usage());
+      pool_.trim();
+      if (!governor_.report(reported_bytes_, retained_bytes())) {
+        return;
+      }
+    }
+    if (!not_yet_paired_reads_.empty()) {
+      governor_.degrade(memory_action::SPILL_UNPAIRED, usage());
+      spill_not_yet_paired_reads();
+      if (!governor_.report(reported_bytes_, retained_bytes())) {
+        return;
+      }
+    }
+    if (!table_.empty()) {
+      governor_.degrade(memory_action::SPILL_GROUPS, usage());
+      spill_groups();
+      pool_.trim();
+      governor_.report(reported_bytes_, retained_bytes());
+    }
+  }
+
+  /**
+   * Passes a read whose mate is deduplicated elsewhere to the sink, the
+   * earlier of the two is held until the later one joins it.
+   */
+  void output_orphan(const bam1_t& read) {
+    sink_(&read,
+          read_is_after_mate(read) ? output_kind::JOIN : output_kind::HOLD);
+  }
+
+  void move_not_yet_paired_reads() {
+    for (auto& read : not_yet_paired_reads_) {
+      sink_(read.second.get(), output_kind::HOLD);
+    }
+    not_yet_paired_reads_.clear();
+    not_yet_paired_bytes_ = 0;
+  }
+
+  /** Outputs a read that is not kept with flag 0x400, if requested. */
+  void mark_duplicate(const bam1_t* read) {
+    if (!opts_.mark_duplicates) {
+      return;
+    }
+    if (duplicate_ == nullptr) {
+      duplicate_.reset(bam_init1());
+    }
+    bam_copy1(duplicate_.get(), read);
+    duplicate_->core.flag |= BAM_FDUP;
+    sink_(duplicate_.get());
+  }
+
+  void add_second_read(bam1_t* record, const mate_key& key) {
+    if (opts_.coordinate_order) {
+      add_second_read_in_order(record, key);
+      return;
+    }
+    if (!region_.contains_mate(*record)) {
+      if (!Mode::discard_chimeric || record->core.tid == record->core.mtid) {
+        output_orphan(*record);
+      }
+      return;
+    }
+    if (record->core.mpos < record->core.pos) {
+      // we already saw r1
+      auto r1_key = mate_of(key);
+      // keep paired read only if we kept r1
+      if (current_reads_.find(r1_key) != current_reads_.end()) {
+        paired_read_map_.emplace(key, pooled_copy(pool_, record));
+      } else {
+        // maybe r1 is from a previous bundle
+        auto it = not_yet_paired_reads_.find(r1_key);
+        if (it != not_yet_paired_reads_.end()) {
+          // output directly
+          sink_(it->second.get());
+          sink_(record);
+          not_yet_paired_bytes_ -= record_bytes(*it->second);
+          not_yet_paired_reads_.erase(it);
+        } else if (spilled_first_reads_.erase(r1_key) != 0) {
+          // r1 has been handed over to the orphan store
+          sink_(record, output_kind::JOIN);
+        }
+      }
+    } else {  // >= 0, need to check later
+      paired_read_map_.emplace(key, pooled_copy(pool_, record));
+    }
+  }
+
+  /**
+   * Second reads are output as soon as it is known that their first read has
+   * been kept, which has always been output already.
+   */
+  void add_second_read_in_order(bam1_t* record, const mate_key& key) {
+    if ((record->core.flag & BAM_FMUNMAP) != 0) {
+      // the first read is unmapped
+      return;
+    }
+    if (!region_.contains_mate(*record)) {
+      if (Mode::discard_chimeric && record->core.tid != record->core.mtid) {
+        return;
+      }
+      if (record->core.mtid > record->core.tid ||
+          orphans_.take_kept_first_read(key)) {
+        // first reads on a later reference cannot be waited for
+        sink_(record);
+      } else {
+        mark_duplicate(record);
+      }
+    } else if (kept_first_reads_.erase(key) != 0) {
+      sink_(record);
+    } else if (record->core.mpos < record->core.pos &&
+               current_reads_.find(mate_of(key)) == current_reads_.end()) {
+      // r1 has been dropped
+      mark_duplicate(record);
+    } else {
+      paired_read_map_.emplace(key, pooled_copy(pool_, record));
+    }
+  }
+
+  void output_positions(nonstd::optional<int64_t> start, int32_t bam_pos) {
+    auto max_pos = start.has_value() ? *start - flush_window
+                                     : std::numeric_limits<int64_t>::max();
+    // spilled groups are merged back one position at a time
+    while (!group_runs_.empty() && next_spilled_position() < max_pos) {
+      auto pos = next_spilled_position();
+      restore_groups(pos);
+      output_table(pos + 1, bam_pos);
+    }
+    output_table(max_pos, bam_pos);
+  }
+
+  void output_table(int64_t max_pos, int32_t bam_pos) {
+    table_.flush(max_pos, [this, bam_pos](umi_bundle& bundle) {
+      if (is_paired) {
+        for (auto& group : bundle) {
+          current_reads_.erase(group.key);
+        }
+      }
+      clusterer_(
+          bundle,
+          [this, bam_pos](umi_group& group) {
+            if (is_paired && opts_.coordinate_order) {
+              output_paired_read_in_order(group);
+            } else if (is_paired) {
+              output_paired_read(group, bam_pos);
+            } else {
+              sink_(group.read.get());
+            }
+          },
+          [this](umi_group& group) {
+            if (is_paired) {
+              auto it = paired_read_map_.find(mate_of(group.key));
+              if (it != paired_read_map_.end()) {
+                mark_duplicate(it->second.get());
+                paired_read_map_.erase(it);
+              }
+            }
+            mark_duplicate(group.read.get());
+          });
+    });
+  }
+
+  /**
+   * Outputs a kept first read right away, its mate either is already waiting
+   * or is output once it is read.
+   */
+  void output_paired_read_in_order(umi_group& group) {
+    auto& r1 = group.read;
+    sink_(r1.get());
+    if ((r1->core.flag & BAM_FMUNMAP) != 0) {
+      return;
+    }
+    auto r2_key = mate_of(group.key);
+    if (!region_.contains_mate(*r1)) {
+      if (r1->core.mtid > r1->core.tid) {
+        orphans_.add_kept_first_read(r2_key);
+      }
+      return;
+    }
+    auto it = paired_read_map_.find(r2_key);
+    if (it != paired_read_map_.end()) {
+      sink_(it->second.get());
+      paired_read_map_.erase(it);
+    } else {
+      kept_first_reads_.insert(r2_key);
+    }
+  }
+
+  void output_paired_read(umi_group& group, int32_t bam_pos) {
+    auto& r1 = group.read;
+    if ((r1->core.flag & BAM_FMUNMAP) != 0) {
+      sink_(r1.get());
+    } else if (!region_.contains_mate(*r1)) {
+      // mate is handled by another region
+      output_orphan(*r1);
+    } else if (r1->core.mpos <= bam_pos) {
+      // we can only have the mate if it was before our current position
+      auto it = paired_read_map_.find(mate_of(group.key));
+      if (it != paired_read_map_.end()) {
+        sink_(r1.get());
+        sink_(it->second.get());
+        paired_read_map_.erase(it);
+      } else {
+        add_not_yet_paired_read(group);
+      }
+    } else {
+      add_not_yet_paired_read(group);
+    }
+  }
+
+  void add_not_yet_paired_read(umi_group& group) {
+    auto bytes = record_bytes(*group.read);
+    if (not_yet_paired_reads_.emplace(group.key, std::move(group.read))
+            .second) {
+      not_yet_paired_bytes_ += bytes;
+    }
+    if (not_yet_paired_bytes_ > max_not_yet_paired_bytes_) {
+      spill_not_yet_paired_reads();
+    }
+  }
+
+  /** Keeps only the keys, the mates are joined by the orphan store. */
+  void spill_not_yet_paired_reads() {
+    for (auto& read : not_yet_paired_reads_) {
+      spilled_first_reads_.insert(read.first);
+    }
+    move_not_yet_paired_reads();
+  }
+
+  /**
+   * A temporary file of UMI groups ordered by position, each stored as its
+   * number of reads followed by its kept read. head is the next group.
+   */
+  struct group_run {
+    std::string path;
+    BGZF* file;
+    uint64_t count;
+    bam1_ptr head;
+    read_features<ReadGroup> features;
+  };
+
+  /**
+   * Writes all UMI groups to a temporary file. Their keys stay in the
+   * current reads, so second reads still wait for them.
+   */
+  void spill_groups() {
+    group_runs_.push_back({temporary_file_path(), nullptr, 0,
+                           bam1_ptr(bam_init1()), {}});
+    auto& run = group_runs_.back();
+    run.file = bgzf_open(run.path.c_str(), "wu");
+    if (run.file == nullptr) {
+      throw std::runtime_error(
+          fmt::format("Could not open temporary file '{}'", run.path));
+    }
+    table_.flush(std::numeric_limits<int64_t>::max(),
+                 [this, &run](umi_bundle& bundle) {
+                   for (auto& group : bundle) {
+                     if (bgzf_write(run.file, &group.count,
+                                    sizeof(group.count)) !=
+                             static_cast<ssize_t>(sizeof(group.count)) ||
+                         bam_write1(run.file, group.read.get()) < 0) {
+                       throw std::runtime_error(fmt::format(
+                           "Could not write to temporary file '{}'",
+                           run.path));
+                     }
+                     spilled_positions_.add(group.read->core.pos);
+                   }
+                 });
+    if (bgzf_close(run.file) < 0) {
+      throw std::runtime_error(
+          fmt::format("Could not write to temporary file '{}'", run.path));
+    }
+    run.file = bgzf_open(run.path.c_str(), "r");
+    if (run.file == nullptr) {
+      throw std::runtime_error(
+          fmt::format("Could not open temporary file '{}'", run.path));
+    }
+    if (!read_group(run)) {
+      close_run(group_runs_.size() - 1);
+    }
+  }
+
+  bool read_group(group_run& run) {
+    if (bgzf_read(run.file, &run.count, sizeof(run.count)) !=
+        static_cast<ssize_t>(sizeof(run.count))) {
+      return false;
+    }
+    if (bam_read1(run.file, run.head.get()) < 0) {
+      throw std::runtime_error(
+          fmt::format("Could not read from temporary file '{}'", run.path));
+    }
+    extract_features_(run.head.get(), run.features);
+    return true;
+  }
+
+  void close_run(std::size_t i) {
+    bgzf_close(group_runs_[i].file);
+    std::remove(group_runs_[i].path.c_str());
+    group_runs_.erase(group_runs_.begin() + static_cast<std::ptrdiff_t>(i));
+  }
+
+  int64_t next_spilled_position() const {
+    auto res = std::numeric_limits<int64_t>::max();
+    for (auto& run : group_runs_) {
+      res = std::min(res, run.features.group_key.pos);
+    }
+    return res;
+  }
+
+  /**
+   * Merges the spilled groups of pos into the table. The kept read of the
+   * merged group is chosen as if all reads had been added in memory.
+   */
+  void restore_groups(int64_t pos) {
+    restored_keys_.clear();
+    // older runs first, as their groups have been added first
+    for (auto i = 0ul; i < group_runs_.size();) {
+      auto& run = group_runs_[i];
+      auto has_group = true;
+      while (has_group && run.features.group_key.pos == pos) {
+        auto* read = run.head.get();
+        spilled_positions_.remove(read->core.pos);
+        if (is_paired) {
+          // added again if the read is still kept
+          current_reads_.erase(run.features.key);
+        }
+        update_read_map<ReadGroup, is_paired>(
+            read, run.features.key, run.features.group_key, run.count, table_,
+            pool_, paired_read_map_, current_reads_, opts_.seed,
+            [this](const bam1_t* duplicate) { mark_duplicate(duplicate); });
+        restored_keys_.push_back(run.features.group_key);
+        has_group = read_group(run);
+      }
+      if (has_group) {
+        ++i;
+      } else {
+        close_run(i);
+      }
+    }
+    table_.put_first(pos, restored_keys_);
+  }
+
+  const umi_opts& opts_;
+  dedup_region region_;
+  umi_clusterer& clusterer_;
+  record_pool& pool_;
+  orphan_store& orphans_;
+  memory_governor& governor_;
+  Sink sink_;
+  feature_extractor<Mode> extract_features_;
+  bool has_reads_ = false;
+  int64_t last_output_pos_ = 0l;
+  uint64_t unchecked_reads_ = 0;
+  uint64_t reported_bytes_ = 0;
+
+  dedup_table<ReadGroup> table_;
+  mate_key_set current_reads_;
+  pooled_mate_map not_yet_paired_reads_;
+  pooled_mate_map paired_read_map_;
+  uint64_t max_not_yet_paired_bytes_;
+  uint64_t not_yet_paired_bytes_ = 0;
+  mate_key_set spilled_first_reads_;
+  // mates of first reads that have been output in coordinate order
+  mate_key_set kept_first_reads_;
+  bam1_ptr duplicate_;
+  std::vector<group_run> group_runs_;
+  std::vector<dedup_key<ReadGroup>> restored_keys_;
+  position_counter spilled_positions_;
+};
+
+/** Output records of a deduplicator, with what to do with each of them. */
+struct output_batch {
+  std::vector<bam1_ptr> records;
+  std::vector<output_kind> kinds;
+};
+
+/**
+ * Recycles output batches, such that their records can be reused.
+ */
+class batch_pool {
+ public:
+  output_batch take() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (batches_.empty()) {
+      return {};
+    }
+    auto batch = std::move(batches_.back());
+    batches_.pop_back();
+    return batch;
+  }
+
+  void give(output_batch batch) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    batches_.push_back(std::move(batch));
+  }
+
+ private:
+  std::mutex mutex_;
+  std::vector<output_batch> batches_;
+};
+
+/**
+ * Bounded queue of output batches of a single region. The worker
+ * deduplicating the region blocks when the writer falls behind.
+ */
+class record_channel {
+ public:
+  void push(output_batch batch) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this] {
+      return batches_.size() < max_batches_ || closed_;
+    });
+    if (!closed_) {
+      batches_.push_back(std::move(batch));
+      not_empty_.notify_one();
+    }
+  }
+
+  bool pop(output_batch& batch) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this] { return !batches_.empty() || closed_; });
+    if (batches_.empty()) {
+      return false;
+    }
+    batch = std::move(batches_.front());
+    batches_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+ private:
+  static constexpr std::size_t max_batches_ = 8;
+  std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  std::deque<output_batch> batches_;
+  bool closed_ = false;
+};
+
+/**
+ * Copies output records into batches, full batches are pushed to the
+ * channel and new batches are taken from the pool.
+ */
+template <class Channel, class Pool>
+class channel_sink {
+ public:
+  channel_sink(Channel& channel, Pool& pool)
+      : channel_(channel), pool_(pool), batch_(pool.take()) {}
+
+  void operator()(const bam1_t* read, output_kind kind = output_kind::WRITE) {
+    if (size_ == batch_.records.size()) {
+      batch_.records.emplace_back(bam_init1());
+      batch_.kinds.emplace_back();
+    }
+    bam_copy1(batch_.records[size_].get(), read);
+    batch_.kinds[size_++] = kind;
+    if (size_ == batch_size) {
+      flush();
+    }
+  }
+
+  void flush() {
+    if (size_ > 0) {
+      batch_.records.resize(size_);
+      batch_.kinds.resize(size_);
+      channel_.push(std::move(batch_));
+      batch_ = pool_.take();
+      size_ = 0;
+    }
+  }
+
+ private:
+  Channel& channel_;
+  Pool& pool_;
+  output_batch batch_;
+  std::size_t size_ = 0;
+};
+
+using batch_ring = spsc_ring<output_batch>;
+
+/**
+ * Batches returned by the consumer of a batch_ring, taking a batch never
+ * waits.
+ */
+class batch_ring_pool {
+ public:
+  explicit batch_ring_pool(batch_ring& ring) : ring_(ring) {}
+
+  output_batch take() {
+    output_batch batch;
+    ring_.try_pop(batch);
+    return batch;
+  }
+
+ private:
+  batch_ring& ring_;
+};
+
+/**
+ * Restores the coordinate order of the output of a reference. Records are
+ * held until the release watermark passes their position, records with the
+ * same position keep the order in which they were added. Without coordinate
+ * order records are passed through directly.
+ */
+template <class Sink>
+class reorder_buffer {
+ public:
+  reorder_buffer(bool enabled, Sink sink) : enabled_(enabled), sink_(sink) {}
+
+  /** Orphans are only passed without coordinate order. */
+  void operator()(const bam1_t* read, output_kind kind = output_kind::WRITE) {
+    if (!enabled_) {
+      sink_(read, kind);
+      return;
+    }
+    heap_.push_back({read->core.pos, seq_++, pooled_copy(pool_, read)});
+    std::push_heap(heap_.begin(), heap_.end(), std::greater<entry>());
+  }
+
+  /** Outputs all records before watermark. */
+  void release(int32_t watermark) {
+    while (!heap_.empty() && heap_.front().pos < watermark) {
+      std::pop_heap(heap_.begin(), heap_.end(), std::greater<entry>());
+      sink_(heap_.back().read.get());
+      heap_.pop_back();
+    }
+  }
+
+  void release_all() { release(std::numeric_limits<int32_t>::max()); }
+
+  std::size_t size() const { return heap_.size(); }
+
+  uint64_t bytes() const {
+    return pool_.bytes() + pool_.free_bytes() +
+           heap_.capacity() * sizeof(entry);
+  }
+
+  /** Frees the records kept for reuse. */
+  void trim() { pool_.trim(); }
+
+ private:
+  struct entry {
+    int32_t pos;
+    uint64_t seq;
+    pooled_bam1_ptr read;
+
+    friend bool operator>(const entry& lhs, const entry& rhs) {
+      return std::tie(lhs.pos, lhs.seq) > std::tie(rhs.pos, rhs.seq);
+    }
+  };
+
+  bool enabled_;
+  Sink sink_;
+  record_pool pool_;
+  std::vector<entry> heap_;
+  uint64_t seq_ = 0;
+};
+
+cpg::cpg dedup_progress() {
+  cpg::cpg_cfg prog_cfg{};
+  prog_cfg.unit = "aln";
+  prog_cfg.unit_scale = true;
+  prog_cfg.mininterval = 3;
+  prog_cfg.desc = "Dedup UMIs";
+  return cpg::cpg(prog_cfg);
+}
+
+/**
+ * Deduplicates a coordinate sorted stream, one reference after the other.
+ * For coordinate ordered output, the output is held in a reorder buffer
+ * until neither the retained reads nor the following input can precede it.
+ */
+template <class Mode, class Sink>
+class stream_deduplicator {
+ public:
+  using ReadGroup = typename Mode::read_group;
+
+  stream_deduplicator(const umi_opts& opts,
+                      umi_clusterer& clusterer,
+                      orphan_store& orphans,
+                      memory_governor& governor,
+                      Sink sink)
+      : opts_(opts),
+        clusterer_(clusterer),
+        orphans_(orphans),
+        governor_(governor),
+        reorder_(opts.coordinate_order, sink),
+        records_(opts.coordinate_order) {}
+
+  void add(bam1_t* record, const read_features<ReadGroup>& features) {
+    if ((record->core.flag & BAM_FUNMAP) != 0) {
+      return;
+    }
+    // new ref, so output all previous reads
+    if (region_dedup_ == nullptr ||
+        region_dedup_->region().tid != record->core.tid) {
+      finish();
+      region_dedup_ = std::make_unique<deduplicator>(
+          opts_, whole_reference(record->core.tid), clusterer_, records_,
+          orphans_, governor_, reorder_);
+    }
+    region_dedup_->add(record, features);
+    if (opts_.coordinate_order) {
+      release(record->core.pos);
+    }
+  }
+
+  /**
+   * Adds the first n records in order. Each window of records is prefetched
+   * before it is added, such that the cache misses of a window overlap.
+   */
+  void add(const std::vector<bam1_ptr>& records,
+           const std::vector<read_features<ReadGroup>>& features,
+           std::size_t n) {
+    for (auto beg = 0ul; beg < n; beg += prefetch_window) {
+      auto end = std::min(beg + prefetch_window, n);
+      if (region_dedup_ != nullptr) {
+        for (auto i = beg; i < end; ++i) {
+          region_dedup_->prefetch(records[i].get(), features[i]);
+        }
+      }
+      for (auto i = beg; i < end; ++i) {
+        add(records[i].get(), features[i]);
+      }
+    }
+  }
+
+  void finish() {
+    if (region_dedup_ != nullptr) {
+      region_dedup_->finish();
+      region_dedup_.reset();
+    }
+    reorder_.release_all();
+    governor_.report(reported_bytes_, 0);
+  }
+
+ private:
+  using deduplicator = region_deduplicator<Mode, reorder_buffer<Sink>&>;
+
+  /**
+   * Outputs the records that precede the retained reads, the reads spilled
+   * to disk and the input position pos.
+   */
+  void release(int32_t pos) {
+    reorder_.release(min_retained_position(pos));
+    if (reorder_.size() > max_reorder_size_) {
+      // second reads waiting for a missing first read hold back the output
+      region_dedup_->purge_waiting_mates(pos);
+      reorder_.release(min_retained_position(pos));
+      if (reorder_.size() > max_reorder_size_ / 2) {
+        max_reorder_size_ *= 2;
+      }
+    }
+    if (governor_.enabled() && ++unchecked_reads_ == memory_check_interval) {
+      unchecked_reads_ = 0;
+      if (governor_.report(reported_bytes_, reorder_.bytes())) {
+        memory_usage usage;
+        usage.reorder = reorder_.bytes();
+        governor_.degrade(memory_action::FREE_RECORDS, usage);
+        reorder_.trim();
+        governor_.report(reported_bytes_, reorder_.bytes());
+      }
+    }
+  }
+
+  int32_t min_retained_position(int32_t pos) const {
+    return std::min({records_.min_position(),
+                     region_dedup_->min_spilled_position(), pos});
+  }
+
+  const umi_opts& opts_;
+  umi_clusterer& clusterer_;
+  orphan_store& orphans_;
+  memory_governor& governor_;
+  uint64_t unchecked_reads_ = 0;
+  uint64_t reported_bytes_ = 0;
+  reorder_buffer<Sink> reorder_;
+  record_pool records_;
+  std::unique_ptr<deduplicator> region_dedup_;
+  std::size_t max_reorder_size_ = 1ul << 16u;
+};
+
+template <class Mode>
+void dedup_stream(samFile* file,
+                  bam_hdr_t* bam_hdr,
+                  const umi_opts& opts,
+                  orphan_writer& out,
+                  umi_clusterer& clusterer,
+                  orphan_store& orphans,
+                  memory_governor& governor) {
+  using ReadGroup = typename Mode::read_group;
+  stream_deduplicator<Mode, orphan_writer&> stream_dedup(
+      opts, clusterer, orphans, governor, out);
+  feature_extractor<Mode> extract_features(opts);
+
+  auto progress = dedup_progress();
+  input_batch<ReadGroup> input;
+  auto read = [file, bam_hdr](bam1_t* record) {
+    return sam_read1(file, bam_hdr, record) > 0;
+  };
+  while (read_input_batch(input, extract_features, read)) {
+    stream_dedup.add(input.records, input.features, input.size);
+    progress.update(input.size);
+  }
+  stream_dedup.finish();
+}
+
+// the pipeline below needs a reader, a deduplicating and a writing thread
+// besides at least one feature worker, fewer threads deduplicate serially
+constexpr uint64_t min_pipeline_threads = 4;
+
+/**
+ * Deduplicates a coordinate sorted stream in a pipeline: one thread reads
+ * records, feature workers extract UMI, position, read group and mate key,
+ * the calling thread only updates the deduplication state and another thread
+ * writes the output. Batches are passed on single producer, single consumer
+ * rings, the batches are distributed round robin over the feature workers
+ * such that their order is kept. Reading, deduplicating and writing take
+ * three of the given threads, the others extract features, so it needs at
+ * least min_pipeline_threads.
+ */
+template <class Mode>
+void dedup_pipeline(samFile* file,
+                    bam_hdr_t* bam_hdr,
+                    const umi_opts& opts,
+                    orphan_writer& out,
+                    umi_clusterer& clusterer,
+                    orphan_store& orphans,
+                    memory_governor& governor) {
+  using ReadGroup = typename Mode::read_group;
+  using batch = input_batch<ReadGroup>;
+  constexpr std::size_t ring_capacity = 4;
+  // reading, deduplicating and writing take one thread each
+  std::size_t num_workers = opts.threads - 3;
+
+  std::vector<std::unique_ptr<spsc_ring<batch>>> decoded;
+  std::vector<std::unique_ptr<spsc_ring<batch>>> extracted;
+  for (auto i = 0ul; i < num_workers; ++i) {
+    decoded.push_back(std::make_unique<spsc_ring<batch>>(ring_capacity));
+    extracted.push_back(std::make_unique<spsc_ring<batch>>(ring_capacity));
+  }
+  // large enough to hold all batches, so returning a batch never waits
+  spsc_ring<batch> free_batches((2 * ring_capacity + 2) * num_workers + 2);
+  batch_ring output(ring_capacity);
+  batch_ring free_output(4 * ring_capacity);
+
+  std::atomic<bool> failed{false};
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  auto close_all = [&]() {
+    for (auto i = 0ul; i < num_workers; ++i) {
+      decoded[i]->close();
+      extracted[i]->close();
+    }
+    free_batches.close();
+    output.close();
+    free_output.close();
+  };
+  auto fail = [&]() {
+    std::lock_guard<std::mutex> lock(error_mutex);
+    if (!error) {
+      error = std::current_exception();
+    }
+    failed = true;
+    close_all();
+  };
+
+  std::vector<std::thread> threads;
+  threads.emplace_back([&]() {
+    try {
+      for (auto i = 0ul;; ++i) {
+        batch input;
+        free_batches.try_pop(input);
+        input.size = 0;
+        for (; input.size < batch_size; ++input.size) {
+          if (input.size == input.records.size()) {
+            input.records.emplace_back(bam_init1());
+          }
+          if (sam_read1(file, bam_hdr, input.records[input.size].get()) <= 0) {
+            break;
+          }
+        }
+        auto last = input.size < batch_size;
+        if ((input.size > 0 && !decoded[i % num_workers]->push(std::move(input))) ||
+            last) {
+          break;
+        }
+      }
+      for (auto& ring : decoded) {
+        ring->close();
+      }
+    } catch (...) {
+      fail();
+    }
+  });
+  for (auto w = 0ul; w < num_workers; ++w) {
+    threads.emplace_back([&, w]() {
+      try {
+        feature_extractor<Mode> extract_features(opts);
+        batch input;
+        while (decoded[w]->pop(input)) {
+          input.features.resize(input.size);
+          for (auto i = 0ul; i < input.size; ++i) {
+            input.features[i] = read_features<ReadGroup>{};
+            extract_features(input.records[i].get(), input.features[i]);
+          }
+          if (!extracted[w]->push(std::move(input))) {
+            break;
+          }
+        }
+        extracted[w]->close();
+      } catch (...) {
+        fail();
+      }
+    });
+  }
+  threads.emplace_back([&]() {
+    try {
+      output_batch records;
+      while (output.pop(records)) {
+        for (auto i = 0ul; i < records.records.size(); ++i) {
+          out(records.records[i].get(), records.kinds[i]);
+        }
+        free_output.push(std::move(records));
+      }
+    } catch (...) {
+      fail();
+    }
+  });
+
+  try {
+    batch_ring_pool output_pool(free_output);
+    channel_sink<batch_ring, batch_ring_pool> sink(output, output_pool);
+    stream_deduplicator<Mode, channel_sink<batch_ring, batch_ring_pool>&>
+        stream_dedup(opts, clusterer, orphans, governor, sink);
+    auto progress = dedup_progress();
+    batch input;
+    for (auto i = 0ul; extracted[i % num_workers]->pop(input); ++i) {
+      stream_dedup.add(input.records, input.features, input.size);
+      progress.update(input.size);
+      free_batches.push(std::move(input));
+    }
+    if (!failed) {
+      stream_dedup.finish();
+      sink.flush();
+    }
+    output.close();
+  } catch (...) {
+    fail();
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+/**
+ * Returns true if the read is grouped by region_deduplicator::add and may
+ * therefore trigger the output of previous positions.
+ */
+bool read_is_grouped(const bam1_t& read, const umi_opts& opts) {
+  if ((read.core.flag & BAM_FUNMAP) != 0) {
+    return false;
+  }
+  if (!opts.paired) {
+    return true;
+  }
+  if ((read.core.flag & BAM_FMUNMAP) != 0 &&
+      opts.unpaired_reads == READ_HANDLING::DISCARD) {
+    return false;
+  }
+  if ((read.core.flag & BAM_FREAD2) != 0) {
+    return false;
+  }
+  return (read.core.flag & BAM_FPAIRED) == 0 ||
+         read.core.tid == read.core.mtid ||
+         opts.chimeric_pairs == READ_HANDLING::USE;
+}
+
+/**
+ * Returns the range of (virtual) file offsets of the reads overlapping
+ * [beg, end of reference).
+ */
+std::pair<uint64_t, uint64_t> file_span(const hts_idx_t* idx,
+                                        int32_t tid,
+                                        int32_t beg) {
+  auto span = std::make_pair(std::numeric_limits<uint64_t>::max(), 0ul);
+  hts_itr_t* iter =
+      sam_itr_queryi(idx, tid, beg, std::numeric_limits<int32_t>::max());
+  if (iter != nullptr) {
+    for (int i = 0; i < iter->n_off; ++i) {
+      span.first = std::min(span.first, iter->off[i].u);
+      span.second = std::max(span.second, iter->off[i].v);
+    }
+    hts_itr_destroy(iter);
+  }
+  return span;
+}
+
+constexpr int32_t cut_scan_margin = 4096;
+constexpr uint64_t cut_scan_max_reads = 1ul << 20u;
+
+/**
+ * Returns true if the 5' end of a reverse read is soft clipped by more than
+ * cut_scan_margin. Its 5' position may then lie after a cut that has been
+ * chosen without seeing the read.
+ */
+bool exceeds_cut_soft_clip(const bam1_t& read) {
+  if (!bam_is_rev(&read) || read.core.n_cigar == 0) {
+    return false;
+  }
+  auto last = bam_get_cigar(&read)[read.core.n_cigar - 1];
+  return (last & BAM_CIGAR_MASK) == BAM_CSOFT_CLIP &&
+         (last >> BAM_CIGAR_SHIFT) > static_cast<uint32_t>(cut_scan_margin);
+}
+// regions smaller than this (in virtual file offsets) are not split further
+constexpr uint64_t min_region_span = 1ul << 36u;
+
+/**
+ * Finds the first position in [from, to) at which a reference can be cut
+ * without changing the result: all reads before the cut are output before
+ * the first read after the cut is grouped, as it starts more than 1000bp
+ * after the 5' ends of all previous reads. Reads that are not scanned end
+ * before from - cut_scan_margin, so their 5' ends lie before from unless
+ * exceeds_cut_soft_clip is true for them.
+ */
+nonstd::optional<int32_t> find_safe_cut(samFile* file,
+                                        const hts_idx_t* idx,
+                                        int32_t tid,
+                                        int32_t from,
+                                        int32_t to,
+                                        const umi_opts& opts) {
+  nonstd::optional<int32_t> cut;
+  hts_itr_t* iter =
+      sam_itr_queryi(idx, tid, std::max(0, from - cut_scan_margin), to);
+  if (iter == nullptr) {
+    return cut;
+  }
+  bam1_t* record = bam_init1();
+  // reads not returned by the query end before from - cut_scan_margin
+  int64_t reach = from;
+  int32_t last_pos = -1;
+  uint64_t num_reads = 0;
+  while (sam_itr_next(file, iter, record) >= 0 &&
+         ++num_reads < cut_scan_max_reads) {
+    auto is_first_at_pos = record->core.pos != last_pos;
+    last_pos = record->core.pos;
+    if (!read_is_grouped(*record, opts)) {
+      continue;
+    }
+    int64_t start = 0;
+    int64_t pos = 0;
+    bool is_spliced = false;
+    std::tie(start, pos, is_spliced) =
+        get_read_position(record, opts.soft_clip_threshold);
+    // only a grouped read that comes first at its position can open a
+    // region, a second read before it would be paired before the previous
+    // positions are output
+    if (record->core.pos >= from && is_first_at_pos && reach + 1000 < start) {
+      cut = record->core.pos;
+      break;
+    }
+    reach = std::max({reach, start, pos});
+  }
+  bam_destroy1(record);
+  hts_itr_destroy(iter);
+  return cut;
+}
+
+/**
+ * Splits the alignment file into regions that are deduplicated independently,
+ * skipping references without any mapped reads. Large references are cut
+ * into regions of about the same file size at safe cut points.
+ */
+std::vector<dedup_region> index_regions(samFile* file,
+                                        const hts_idx_t* idx,
+                                        const bam_hdr_t* bam_hdr,
+                                        const umi_opts& opts) {
+  std::vector<std::pair<int32_t, std::pair<uint64_t, uint64_t>>> references;
+  uint64_t total_span = 0;
+  for (int32_t tid = 0; tid < bam_hdr->n_targets; ++tid) {
+    uint64_t mapped = 0;
+    uint64_t unmapped = 0;
+    if (hts_idx_get_stat(idx, tid, &mapped, &unmapped) == 0 && mapped == 0) {
+      continue;
+    }
+    auto span = file_span(idx, tid, 0);
+    if (span.first < span.second) {
+      total_span += span.second - span.first;
+    }
+    references.emplace_back(tid, span);
+  }
+
+  auto region_span =
+      std::max(min_region_span, total_span / std::max(1ul, opts.threads * 4));
+  std::vector<dedup_region> regions;
+  for (auto& ref : references) {
+    auto tid = ref.first;
+    auto span = ref.second;
+    auto ref_len = static_cast<int32_t>(bam_hdr->target_len[tid]);
+    int32_t beg = 0;
+    auto num_regions =
+        span.first < span.second ? (span.second - span.first) / region_span
+                                 : 0;
+    for (auto i = 1ul; i < num_regions; ++i) {
+      auto target = span.first + i * (span.second - span.first) / num_regions;
+      // first position after beg whose reads start at or after target
+      int32_t lo = beg + 1;
+      int32_t hi = ref_len;
+      while (lo < hi) {
+        auto mid = lo + (hi - lo) / 2;
+        if (file_span(idx, tid, mid).first < target) {
+          lo = mid + 1;
+        } else {
+          hi = mid;
+        }
+      }
+      if (lo >= ref_len) {
+        break;
+      }
+      auto cut = find_safe_cut(file, idx, tid, lo, ref_len, opts);
+      if (!cut.has_value()) {
+        break;
+      }
+      regions.push_back({tid, beg, *cut});
+      beg = *cut;
+    }
+    regions.push_back({tid, beg, std::numeric_limits<int32_t>::max()});
+  }
+  return regions;
+}
+
+/**
+ * Deduplicates the regions of an indexed alignment file on several threads.
+ * Each worker opens its own file handle and deduplicates one region at a
+ * time, the output is written in region order by the calling thread, which
+ * is counted as one of the given threads. Reads whose mate lies in another
+ * region are paired by the orphan store as they are written, so the output
+ * is the same as deduplicating the whole file on a single thread.
+ */
+template <class Mode>
+void dedup_parallel(const std::string& input,
+                    samFile* file,
+                    const hts_idx_t* idx,
+                    bam_hdr_t* bam_hdr,
+                    const umi_opts& opts,
+                    orphan_writer& out,
+                    umi_clusterer& clusterer,
+                    orphan_store& orphans,
+                    memory_governor& governor) {
+  auto regions = index_regions(file, idx, bam_hdr, opts);
+  std::vector<record_channel> channels(regions.size());
+  batch_pool pool;
+
+  std::atomic<std::size_t> next_region{0};
+  std::atomic<uint64_t> processed_reads{0};
+  std::atomic<uint64_t> long_clipped_reads{0};
+  std::atomic<bool> failed{false};
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  std::mutex clusterer_mutex;
+
+  auto worker = [&]() {
+    try {
+      samFile* worker_file = hts_open(input.c_str(), "r");
+      if (worker_file == nullptr) {
+        throw std::runtime_error(
+            fmt::format("Could not open file '{}'", input));
+      }
+      bam_hdr_t* file_hdr = sam_hdr_read(worker_file);
+      umi_clusterer worker_clusterer(opts.method, opts.max_ham_dist);
+      record_pool records;
+      feature_extractor<Mode> extract_features(opts);
+      input_batch<typename Mode::read_group> reads;
+      for (auto i = next_region++; i < regions.size() && !failed;
+           i = next_region++) {
+        auto& region = regions[i];
+        channel_sink<record_channel, batch_pool> sink(channels[i], pool);
+        region_deduplicator<Mode, channel_sink<record_channel, batch_pool>&>
+            region_dedup(opts, region, worker_clusterer, records, orphans,
+                         governor, sink);
+        hts_itr_t* iter =
+            sam_itr_queryi(idx, region.tid, region.beg, region.end);
+        if (iter == nullptr) {
+          throw std::runtime_error(fmt::format(
+              "Could not query reference '{}' in file '{}'",
+              bam_hdr->target_name[region.tid], input));
+        }
+        auto is_cut = region.end != std::numeric_limits<int32_t>::max();
+        uint64_t count = 0;
+        int ret = 0;
+        auto read = [&](bam1_t* record) {
+          while ((ret = sam_itr_next(worker_file, iter, record)) >= 0) {
+            if (++count % batch_size == 0) {
+              processed_reads += batch_size;
+            }
+            // reads overlapping the region start belong to the previous region
+            if (record->core.pos >= region.beg) {
+              if (is_cut && exceeds_cut_soft_clip(*record)) {
+                ++long_clipped_reads;
+              }
+              return true;
+            }
+          }
+          return false;
+        };
+        while (read_input_batch(reads, extract_features, read)) {
+          region_dedup.add(reads.records, reads.features, reads.size);
+        }
+        processed_reads += count % batch_size;
+        hts_itr_destroy(iter);
+        if (ret < -1) {
+          throw std::runtime_error(
+              fmt::format("Failed to read from file '{}'", input));
+        }
+        region_dedup.finish();
+        sink.flush();
+        channels[i].close();
+      }
+      bam_hdr_destroy(file_hdr);
+      hts_close(worker_file);
+      std::lock_guard<std::mutex> lock(clusterer_mutex);
+      clusterer.merge(worker_clusterer);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(error_mutex);
+      if (!error) {
+        error = std::current_exception();
+      }
+      failed = true;
+      for (auto& channel : channels) {
+        channel.close();
+      }
+    }
+  };
+
+  // the calling thread writes the output
+  auto num_workers =
+      std::min<std::size_t>(std::max(opts.threads, 2ul) - 1, regions.size());
+  std::vector<std::thread> workers;
+  workers.reserve(num_workers);
+  for (auto i = 0ul; i < num_workers; ++i) {
+    workers.emplace_back(worker);
+  }
+
+  auto progress = dedup_progress();
+  uint64_t reported_reads = 0;
+  output_batch batch;
+  for (auto i = 0ul; i < regions.size() && !failed; ++i) {
+    while (channels[i].pop(batch)) {
+      for (auto j = 0ul; j < batch.records.size(); ++j) {
+        out(batch.records[j].get(), batch.kinds[j]);
+      }
+      pool.give(std::move(batch));
+      auto processed = processed_reads.load();
+      progress.update(processed - reported_reads);
+      reported_reads = processed;
+    }
+  }
+  for (auto& w : workers) {
+    w.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+  progress.update(processed_reads.load() - reported_reads);
+  if (long_clipped_reads > 0) {
+    std::cerr << fmt::format(
+                     "{} reads before a cut between regions are soft clipped "
+                     "by more than {}bp, their duplicates after the cut may "
+                     "have been kept. Use --threads 1 for such data.",
+                     long_clipped_reads.load(), cut_scan_margin)
+              << std::endl;
+  }
+}
+
+template <class Mode>
+void dedup_reads(const std::string& input,
+                 samFile* file,
+                 const hts_idx_t* idx,
+                 bam_hdr_t* bam_hdr,
+                 const umi_opts& opts,
+                 record_writer& out) {
+  constexpr bool is_paired = Mode::is_paired;
+  umi_clusterer clusterer(opts.method, opts.max_ham_dist);
+  memory_governor governor(opts.max_memory);
+  orphan_store orphans(opts.max_orphan_memory,
+                       opts.unpaired_reads == READ_HANDLING::USE, governor);
+  orphan_writer writer(out, orphans);
+  if (idx != nullptr) {
+    dedup_parallel<Mode>(input, file, idx, bam_hdr, opts, writer, clusterer,
+                         orphans, governor);
+  } else if (opts.threads >= min_pipeline_threads) {
+    dedup_pipeline<Mode>(file, bam_hdr, opts, writer, clusterer, orphans,
+                         governor);
+  } else {
+    dedup_stream<Mode>(file, bam_hdr, opts, writer, clusterer, orphans,
+                       governor);
+  }
+  if (is_paired) {
+    orphans.output(out);
+  }
+  governor.summary();
+  if (clusterer.positions() > 0) {
+    std::cerr << fmt::format(
+                     "Positions: {}, UMIs per position: {:.2f} (mean), {} "
+                     "(max)",
+                     clusterer.positions(),
+                     static_cast<double>(clusterer.total_umis_per_position()) /
+                         clusterer.positions(),
+                     clusterer.max_umis_per_position())
+              << std::endl;
+  }
+}
+}  // namespace
+
+void dedup(const std::string& input, const std::string& output, umi_opts opts) {
+  // input and output share one pool: with --fix-flags all of its threads
+  // decompress while deduplicating and compress while fixing the flags
+  hts_thread_pool io_pool(std::max(opts.ithreads, opts.othreads));
+
+  samFile* file = hts_open(input.c_str(), "r");
+
+  if (file == nullptr) {
+    throw std::runtime_error(fmt::format("Could not open file '{}'", input));
+  }
+
+  io_pool.attach(file);
+
+  // read header
+  bam_hdr_t* bam_hdr = sam_hdr_read(file);
+
+  // require sorted bam file
+  if ((bam_hdr->l_text > 3) && (strncmp(bam_hdr->text, "@HD", 3) == 0)) {
+    auto* p = strstr(bam_hdr->text, "\tSO:coordinate");
+    auto* q = strchr(bam_hdr->text, '\n');
+    // Looking for SO:coordinate within the @HD line only
+    // (e.g. must ignore in a @CO comment line later in header)
+    if ((p == nullptr) || (p >= q)) {
+      throw std::runtime_error(
+          fmt::format("BAM file needs to be coordinate sorted!"));
+    }
+  } else {
+    throw std::runtime_error(
+        fmt::format("BAM file needs to be coordinate sorted!"));
+  }
+
+  // references can only be processed in parallel if we can jump to them
+  hts_idx_t* idx = nullptr;
+  // regions output in coordinate order are deduplicated as a stream
+  if (opts.threads > 1 && input != "-" && !opts.coordinate_order) {
+    idx = sam_index_load(file, input.c_str());
+    if (idx == nullptr) {
+      std::cerr << "No index found for '" << input
+                << "', deduplicating one reference after the other."
+                << std::endl;
+    }
+  }
+
+  samFile* out = hts_open(output.c_str(), opts.uncompressed           ? "wbu"
+                                          : ends_with(output, ".bam") ? "wb"
+                                                                      : "w");
+  if (out == nullptr) {
+    throw std::runtime_error(fmt::format("Could not open file '{}'", output));
+  }
+
+  io_pool.attach(out);
+
+  // the deduplicated reads are kept as records until the flags are fixed, so
+  // they are only encoded once when writing the output. The threads are busy
+  // deduplicating, so full runs are spilled by the thread writing them.
+  std::unique_ptr<name_sorter> sorter;
+  if (opts.fix_flags) {
+    set_sort_order(bam_hdr, "queryname", "lexicographical");
+    sorter = std::make_unique<name_sorter>(opts.sort_memory, 1);
+  }
+
+  if (sam_hdr_write(out, bam_hdr) < -1) {
+    throw std::runtime_error(
+        fmt::format("Could not write header to file '{}'", output));
+  }
+
+  record_writer writer(out, bam_hdr, sorter.get());
+  dispatch_mode(opts, [&](auto mode) {
+    dedup_reads<decltype(mode)>(input, file, idx, bam_hdr, opts, writer);
+  });
+
+  if (sorter) {
+    sorter->finish();
+    fix_read_flags([&sorter](bam1_t* read) { return sorter->next(read); },
+                   bam_hdr, opts.sort_adjacent_pairs, out,
+                   std::max(opts.threads, 1ul));
+  }
+
+  if (idx != nullptr) {
+    hts_idx_destroy(idx);
+  }
   bam_hdr_destroy(bam_hdr);
 
   hts_close(file);
@@ -0,0 +1,132 @@
+#include <fumi_tools/hamming.hpp>
+
+#include <algorithm>
+#include <limits>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define FUMI_TOOLS_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace fumi_tools {
+namespace {
+
+using hamming_kernel = void (*)(const packed_sequence&,
+                                const uint64_t*,
+                                const uint64_t*,
+                                std::size_t,
+                                uint32_t*);
+
+void hamming_distances_generic(const packed_sequence& query,
+                               const uint64_t* bases,
+                               const uint64_t* masks,
+                               std::size_t n,
+                               uint32_t* dists) {
+  for (auto i = 0ul; i < n; ++i) {
+    dists[i] = hamming_distance(query, {bases[i], masks[i]});
+  }
+}
+
+#ifdef FUMI_TOOLS_X86_KERNELS
+/** Same as the generic kernel, but compiled to use the popcnt instruction. */
+__attribute__((target("sse4.2,popcnt"))) void hamming_distances_sse42(
+    const packed_sequence& query,
+    const uint64_t* bases,
+    const uint64_t* masks,
+    std::size_t n,
+    uint32_t* dists) {
+  for (auto i = 0ul; i < n; ++i) {
+    auto diff = query.bases ^ bases[i];
+    diff = ((diff | (diff >> 1u)) & 0x5555555555555555ull) |
+           (query.mask ^ masks[i]);
+    dists[i] = static_cast<uint32_t>(__builtin_popcountll(diff));
+  }
+}
+
+/**
+ * Compares four candidates at once, AVX2 has no 64 bit popcount so the bits
+ * are counted per nibble with a lookup table and summed per candidate.
+ */
+__attribute__((target("avx2"))) void hamming_distances_avx2(
+    const packed_sequence& query,
+    const uint64_t* bases,
+    const uint64_t* masks,
+    std::size_t n,
+    uint32_t* dists) {
+  const auto query_bases = _mm256_set1_epi64x(static_cast<int64_t>(query.bases));
+  const auto query_mask = _mm256_set1_epi64x(static_cast<int64_t>(query.mask));
+  const auto low_bits = _mm256_set1_epi64x(0x5555555555555555ll);
+  const auto nibble = _mm256_set1_epi8(0x0f);
+  const auto lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2,
+                                       3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3, 1, 2,
+                                       2, 3, 2, 3, 3, 4);
+  const auto lower_halves = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+  auto i = 0ul;
+  for (; i + 4 <= n; i += 4) {
+    auto diff = _mm256_xor_si256(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bases + i)),
+        query_bases);
+    diff = _mm256_and_si256(_mm256_or_si256(diff, _mm256_srli_epi64(diff, 1)),
+                            low_bits);
+    diff = _mm256_or_si256(
+        diff, _mm256_xor_si256(_mm256_loadu_si256(
+                                   reinterpret_cast<const __m256i*>(masks + i)),
+                               query_mask));
+    auto counts = _mm256_add_epi8(
+        _mm256_shuffle_epi8(lookup, _mm256_and_si256(diff, nibble)),
+        _mm256_shuffle_epi8(
+            lookup, _mm256_and_si256(_mm256_srli_epi16(diff, 4), nibble)));
+    auto sums = _mm256_sad_epu8(counts, _mm256_setzero_si256());
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dists + i),
+                     _mm256_castsi256_si128(
+                         _mm256_permutevar8x32_epi32(sums, lower_halves)));
+  }
+  hamming_distances_generic(query, bases + i, masks + i, n - i, dists + i);
+}
+#endif
+
+hamming_kernel select_kernel() {
+#ifdef FUMI_TOOLS_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return hamming_distances_avx2;
+  }
+  if (__builtin_cpu_supports("popcnt")) {
+    return hamming_distances_sse42;
+  }
+#endif
+  return hamming_distances_generic;
+}
+}  // namespace
+
+void hamming_distances(const packed_sequence& query,
+                       const packed_sequences& candidates,
+                       std::size_t beg,
+                       std::size_t end,
+                       uint32_t* dists) {
+  static const auto kernel = select_kernel();
+  kernel(query, candidates.bases() + beg, candidates.masks() + beg, end - beg,
+         dists);
+}
+
+std::size_t closest_sequence(const packed_sequence& query,
+                             const packed_sequences& candidates,
+                             uint32_t& min_dist) {
+  constexpr std::size_t chunk_size = 256;
+  uint32_t dists[chunk_size];
+  auto min_i = candidates.size();
+  min_dist = std::numeric_limits<uint32_t>::max();
+  for (auto beg = 0ul; beg < candidates.size(); beg += chunk_size) {
+    auto end = std::min(beg + chunk_size, candidates.size());
+    hamming_distances(query, candidates, beg, end, dists);
+    for (auto i = beg; i < end; ++i) {
+      if (dists[i - beg] < min_dist) {
+        min_dist = dists[i - beg];
+        min_i = i;
+      }
+    }
+  }
+  return min_i;
+}
+
+}  // namespace fumi_tools
@@ -1,5 +1,8 @@
 #include <cstdint>
 #include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include <nonstd/string_view.hpp>
 
@@ -12,6 +15,7 @@
 #include <fumi_tools/umi_opts.hpp>
 #include <fumi_tools/dedup.hpp>
 #include <fumi_tools/helper.hpp>
+#include <fumi_tools/name_sort.hpp>
 
 namespace {
 
@@ -24,13 +28,22 @@ void required_options(cxxopts::Options& opts,
   }
 }
 
-void check_valid_values(const std::string& val, const std::initializer_list<std::string>& valid_values, const std::string& option_name){
-  bool valid = std::find(valid_values.begin(), valid_values.end(), val) != valid_values.end();
-  if(!valid){
-      throw std::runtime_error(fmt::format("Unknown value passed to option '{}': '{}'. Valid options are: {}", option_name, val, fmt::join(valid_values, "|")));
-   }
+template <class Enum>
+Enum parse_value(const std::string& val, const std::vector<std::pair<std::string, Enum>>& valid_values, const std::string& option_name){
+  std::vector<std::string> names;
+  for (auto& valid_value : valid_values) {
+    if (valid_value.first == val) {
+      return valid_value.second;
+    }
+    names.push_back(valid_value.first);
+  }
+  throw std::runtime_error(fmt::format("Unknown value passed to option '{}': '{}'. Valid options are: {}", option_name, val, fmt::join(names, "|")));
 }
 
+const std::vector<std::pair<std::string, fumi_tools::READ_HANDLING>> read_handling_values = {
+    {"use", fumi_tools::READ_HANDLING::USE},
+    {"discard", fumi_tools::READ_HANDLING::DISCARD}};
+
 enum class Format { BAM, SAM, UNKNOWN };
 
 Format check_format(nonstd::string_view sv) {
@@ -54,16 +67,25 @@ auto parse_options(int argc, char* argv[]) {
   opts.add_options("help")
       ("i,input", "Input SAM or BAM file.", cxxopts::value<std::string>())
       ("o,output", "Output SAM or BAM file. To output SAM on stdout use '-'.", cxxopts::value<std::string>())
-//      ("method", "Which method to use to collapse the UMIs. ", cxxopts::value<std::string>()->default_value("")) only unique supported for now
+      ("method", "Which method to use to collapse the UMIs. (unique|cluster|adjacency|directional)", cxxopts::value<std::string>()->default_value("unique"))
+      ("max-hamming-dist", "Maximum hamming distance for which to collapse UMIs.", cxxopts::value<unsigned int>(umi_opts.max_ham_dist)->default_value("1"))
+      ("umi-tag", "Read the UMI from this BAM tag (e.g. RX or OX) instead of the read name.", cxxopts::value<std::string>(umi_opts.umi_tag))
       ("start-only", "Reads only need the same start position and the same UMI to be considered duplicates.")
       ("paired", "Specifiy this option if your alignment file contains paired end reads.")
-      ("chimeric-pairs", "How to handle chimeric read pairs. (discard|use)", cxxopts::value<std::string>(umi_opts.chimeric_pairs)->default_value("use"))
-      ("unpaired-reads", "How to handle unpaired reads (e.g. mate did not align) (discard|use)", cxxopts::value<std::string>(umi_opts.unpaired_reads)->default_value("use"))
+      ("chimeric-pairs", "How to handle chimeric read pairs. (discard|use)", cxxopts::value<std::string>()->default_value("use"))
+      ("unpaired-reads", "How to handle unpaired reads (e.g. mate did not align) (discard|use)", cxxopts::value<std::string>()->default_value("use"))
       ("uncompressed", "Output uncompressed BAM.")
+      ("coordinate-order", "Output the kept reads in coordinate order instead of grouped by read pair, no name sort is needed afterwards.")
+      ("mark-duplicates", "Output duplicates with flag 0x400 instead of removing them. Requires --coordinate-order.")
+      ("fix-flags", "Sort the kept reads by name and fix their flags in this process, like piping the output through fumi_tools_fix_flags --name-sort.")
+      ("sort-adjacent-pairs", "With --fix-flags, sort pairs such that R2 always follows R1.")
+      ("sort-memory", "Maximum memory used for sorting with --fix-flags. Units can be K/M/G.", cxxopts::value<std::string>()->default_value("3G"))
       ("seed", "Random number generator seed.", cxxopts::value<uint64_t>(umi_opts.seed)->default_value("42"))
+      ("threads", "Number of threads, including the ones reading and writing, not counting --input-threads and --output-threads. References of an indexed input file are deduplicated in parallel, otherwise reading, deduplication and writing run in a pipeline from 4 threads on.", cxxopts::value<uint64_t>(umi_opts.threads)->default_value("1"))
+      ("max-orphan-memory", "Maximum memory in MB used to buffer paired reads whose mate has not been seen yet. Further reads are spilled to temporary files.", cxxopts::value<uint64_t>()->default_value("1024"))
+      ("max-memory", "Maximum memory used by the deduplication state of all threads, not counting --sort-memory. Units can be K/M/G. When it is reached, waiting reads and UMI groups are spilled to temporary files. No limit by default.", cxxopts::value<std::string>())
       ("version", "Display version number.")
       ("h,help", "Show this dialog.")
-//      ("max-hamming-dist", "Maximum hamming distance for which to collapse umis.", cxxopts::value<uint32_t>(umi_opts.max_ham_dist)->default_value("1")) not yet supported
       ;
 
   opts.add_options("invisible")
@@ -83,12 +105,36 @@ auto parse_options(int argc, char* argv[]) {
     }
     required_options(
         opts, {"input", "output"});
-    check_valid_values(umi_opts.chimeric_pairs, {"use", "discard"}, "chimeric-pairs");
-    check_valid_values(umi_opts.unpaired_reads, {"use", "discard"}, "unpaired-reads");
+    umi_opts.chimeric_pairs = parse_value(opts["chimeric-pairs"].as<std::string>(), read_handling_values, "chimeric-pairs");
+    umi_opts.unpaired_reads = parse_value(opts["unpaired-reads"].as<std::string>(), read_handling_values, "unpaired-reads");
+    umi_opts.method = parse_value<fumi_tools::METHOD>(opts["method"].as<std::string>(),
+                                                      {{"unique", fumi_tools::METHOD::UNIQUE},
+                                                       {"cluster", fumi_tools::METHOD::CLUSTER},
+                                                       {"adjacency", fumi_tools::METHOD::ADJACENCY},
+                                                       {"directional", fumi_tools::METHOD::DIRECTIONAL}},
+                                                      "method");
+    if (!umi_opts.umi_tag.empty() && umi_opts.umi_tag.size() != 2) {
+      throw std::runtime_error(fmt::format("Option 'umi-tag' needs a two character tag, got '{}'.", umi_opts.umi_tag));
+    }
 
     umi_opts.read_length = opts["paired"].as<bool>() ? false : !opts["start-only"].as<bool>();
     umi_opts.uncompressed = opts["uncompressed"].as<bool>();
     umi_opts.paired = opts["paired"].as<bool>();
+    umi_opts.max_orphan_memory = opts["max-orphan-memory"].as<uint64_t>() << 20u;
+    if (opts.count("max-memory") != 0) {
+      umi_opts.max_memory = fumi_tools::parse_memory(opts["max-memory"].as<std::string>());
+    }
+    umi_opts.coordinate_order = opts["coordinate-order"].as<bool>();
+    umi_opts.mark_duplicates = opts["mark-duplicates"].as<bool>();
+    if (umi_opts.mark_duplicates && !umi_opts.coordinate_order) {
+      throw std::runtime_error("Option 'mark-duplicates' requires option 'coordinate-order'.");
+    }
+    umi_opts.fix_flags = opts["fix-flags"].as<bool>();
+    umi_opts.sort_adjacent_pairs = opts["sort-adjacent-pairs"].as<bool>();
+    umi_opts.sort_memory = fumi_tools::parse_memory(opts["sort-memory"].as<std::string>());
+    if (umi_opts.fix_flags && umi_opts.coordinate_order) {
+      throw std::runtime_error("Options 'fix-flags' and 'coordinate-order' are mutually exclusive.");
+    }
   } catch (const std::exception& e) {
     if (opts["help"].as<bool>() || argc == 1) {
       std::cout << opts.help({"help"}) << std::endl;
@@ -131,9 +177,15 @@ int main(int argc, char* argv[]) {
       return 0;
   }
 
-  fumi_tools::dedup(
-      vm_opts.first["input"].as<std::string>(),
-      vm_opts.first["output"].as<std::string>(),
-      vm_opts.second);
+  // catching the error unwinds the stack, which removes the temporary files
+  try {
+    fumi_tools::dedup(
+        vm_opts.first["input"].as<std::string>(),
+        vm_opts.first["output"].as<std::string>(),
+        vm_opts.second);
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
   return 0;
 }
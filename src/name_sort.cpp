@@ -0,0 +1,760 @@
+#include <fumi_tools/name_sort.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <fmt/format.h>
+
+#include <ghc/filesystem.hpp>
+#include <robin_hood/robin_hood.h>
+
+#include <unistd.h>
+
+namespace fumi_tools {
+
+nonstd::string_view get_canonical_name(const bam1_t* record) {
+  // keep only up to first whitespace in case the aligner did not trim the end
+  // off
+  nonstd::string_view qname(bam_get_qname(record),
+                            std::strlen(bam_get_qname(record)));
+  auto end = qname.find_last_not_of(" \t\n");
+  if (end != nonstd::string_view::npos) {
+    qname.remove_suffix(qname.size() - end - 1);
+  }
+  return qname;
+}
+
+namespace {
+/**
+ * Sets the field tag of the @HD line at the start of text to value, or
+ * removes it if value is empty.
+ */
+void set_header_field(std::string& text,
+                      const char* tag,
+                      const std::string& value) {
+  auto end = std::min(text.find('\n'), text.size());
+  auto pos = text.find(fmt::format("\t{}:", tag));
+  auto field = fmt::format("{}:{}", tag, value);
+  if (pos < end) {
+    auto value_end = std::min(text.find_first_of("\t\n", pos + 1), end);
+    if (value.empty()) {
+      text.erase(pos, value_end - pos);
+    } else {
+      text.replace(pos + 1, value_end - pos - 1, field);
+    }
+  } else if (!value.empty()) {
+    text.insert(end, "\t" + field);
+  }
+}
+}  // namespace
+
+void set_sort_order(bam_hdr_t* bam_hdr,
+                    const char* order,
+                    const char* sub_sort) {
+  std::string text(bam_hdr->text, bam_hdr->l_text);
+  if (text.compare(0, 3, "@HD") != 0) {
+    text.insert(0, "@HD\tVN:1.6\n");
+  }
+  set_header_field(text, "SO", order);
+  set_header_field(
+      text, "SS",
+      sub_sort == nullptr ? "" : fmt::format("{}:{}", order, sub_sort));
+  auto* new_text = static_cast<char*>(std::malloc(text.size() + 1));
+  std::memcpy(new_text, text.c_str(), text.size() + 1);
+  std::free(bam_hdr->text);
+  bam_hdr->text = new_text;
+  bam_hdr->l_text = static_cast<uint32_t>(text.size());
+}
+
+uint64_t parse_memory(const std::string& mem) {
+  std::size_t end = 0;
+  uint64_t res = 0;
+  try {
+    res = std::stoull(mem, &end);
+  } catch (const std::exception&) {
+    end = 0;
+  }
+  auto suffix = mem.substr(end);
+  if (end == 0 || suffix.size() > 1) {
+    throw std::runtime_error(fmt::format(
+        "Could not parse memory size '{}', expected e.g. 512M or 3G.", mem));
+  }
+  switch (suffix.empty() ? ' ' : suffix[0]) {
+    case ' ':
+      return res;
+    case 'K':
+    case 'k':
+      return res << 10u;
+    case 'M':
+    case 'm':
+      return res << 20u;
+    case 'G':
+    case 'g':
+      return res << 30u;
+    default:
+      throw std::runtime_error(fmt::format(
+          "Could not parse memory size '{}', expected e.g. 512M or 3G.", mem));
+  }
+}
+
+namespace {
+// numbers the temporary files of all sorters and groupers of the process
+std::atomic<uint64_t> num_temporary_files{0};
+
+std::string temporary_file_path(const char* kind) {
+  return (ghc::filesystem::temp_directory_path() /
+          fmt::format("fumi_tools_{}_{}_{}.tmp", kind, ::getpid(),
+                      num_temporary_files++))
+      .string();
+}
+
+constexpr std::size_t max_block_size = 1ul << 20u;
+// spilled runs merged at a time, which bounds the open temporary files
+constexpr std::size_t max_merge_runs = 64;
+// ranges of equal keys smaller than this are sorted by comparison
+constexpr std::size_t min_radix_size = 64;
+
+/** Bytes [depth, depth + 8) of name, big endian and padded with zeros. */
+uint64_t name_chunk(nonstd::string_view name, std::size_t depth) {
+  uint64_t res = 0;
+  for (auto i = depth; i < depth + 8; ++i) {
+    res <<= 8u;
+    if (i < name.size()) {
+      res |= static_cast<uint8_t>(name[i]);
+    }
+  }
+  return res;
+}
+}  // namespace
+
+/**
+ * Records of a run are stored back to back in blocks of an arena, as core,
+ * data length and data. Only the compact sort keys are moved while sorting.
+ */
+class name_sorter::run {
+ public:
+  explicit run(uint64_t max_bytes)
+      : max_bytes_(max_bytes),
+        block_size_(std::max<std::size_t>(
+            1ul << 12u, std::min<std::size_t>(max_block_size, max_bytes / 16))) {}
+
+  bool full() const {
+    return block_bytes_ +
+               refs_.size() * (sizeof(record_ref) + 2 * sizeof(sort_key)) >
+           max_bytes_;
+  }
+
+  bool empty() const { return refs_.empty(); }
+
+  std::size_t size() const { return keys_.size(); }
+
+  void add(const bam1_t* record) {
+    auto bytes = sizeof(bam1_core_t) + sizeof(int32_t) +
+                 static_cast<std::size_t>(record->l_data);
+    if (blocks_.empty() || block_used_ + bytes > block_size_) {
+      // records larger than a block get a block of their own size
+      auto size = std::max(bytes, block_size_);
+      blocks_.emplace_back(new uint8_t[size]);
+      block_bytes_ += size;
+      block_used_ = 0;
+    }
+    auto* dst = blocks_.back().get() + block_used_;
+    std::memcpy(dst, &record->core, sizeof(bam1_core_t));
+    std::memcpy(dst + sizeof(bam1_core_t), &record->l_data, sizeof(int32_t));
+    std::memcpy(dst + sizeof(bam1_core_t) + sizeof(int32_t), record->data,
+                static_cast<std::size_t>(record->l_data));
+    block_used_ += bytes;
+    refs_.push_back({dst, static_cast<uint32_t>(
+                              get_canonical_name(record).size())});
+  }
+
+  void sort() {
+    keys_.resize(refs_.size());
+    for (auto i = 0ul; i < refs_.size(); ++i) {
+      keys_[i] = {0, static_cast<uint32_t>(i)};
+    }
+    std::vector<sort_key> tmp(keys_.size());
+    sort_keys(keys_.data(), tmp.data(), keys_.size(), 0);
+  }
+
+  /** Canonical name of the i-th record in sorted order. */
+  nonstd::string_view name(std::size_t i) const {
+    return name_of(keys_[i].ref);
+  }
+
+  /** Copies the i-th record in sorted order into record. */
+  void load(std::size_t i, bam1_t* record) const {
+    const auto* src = refs_[keys_[i].ref].record;
+    bam1_t view{};
+    std::memcpy(&view.core, src, sizeof(bam1_core_t));
+    std::memcpy(&view.l_data, src + sizeof(bam1_core_t), sizeof(int32_t));
+    view.m_data = static_cast<uint32_t>(view.l_data);
+    view.data = const_cast<uint8_t*>(src) + sizeof(bam1_core_t) +
+                sizeof(int32_t);
+    bam_copy1(record, &view);
+  }
+
+  void write(const std::string& path) const {
+    BGZF* file = bgzf_open(path.c_str(), "w1");
+    if (file == nullptr) {
+      throw std::runtime_error(
+          fmt::format("Could not open temporary file '{}'", path));
+    }
+    bam1_t* record = bam_init1();
+    for (auto i = 0ul; i < keys_.size(); ++i) {
+      load(i, record);
+      if (bam_write1(file, record) < 0) {
+        bam_destroy1(record);
+        bgzf_close(file);
+        throw std::runtime_error(
+            fmt::format("Could not write to temporary file '{}'", path));
+      }
+    }
+    bam_destroy1(record);
+    if (bgzf_close(file) != 0) {
+      throw std::runtime_error(
+          fmt::format("Could not write to temporary file '{}'", path));
+    }
+  }
+
+ private:
+  struct record_ref {
+    const uint8_t* record;
+    uint32_t name_length;
+  };
+
+  struct sort_key {
+    uint64_t chunk;
+    uint32_t ref;
+  };
+
+  nonstd::string_view name_of(uint32_t ref) const {
+    return {reinterpret_cast<const char*>(refs_[ref].record +
+                                          sizeof(bam1_core_t) +
+                                          sizeof(int32_t)),
+            refs_[ref].name_length};
+  }
+
+  /**
+   * Sorts keys by the names from depth on: a stable LSD radix sort on the
+   * next 8 bytes, then ranges with equal bytes are sorted recursively.
+   */
+  void sort_keys(sort_key* keys,
+                 sort_key* tmp,
+                 std::size_t n,
+                 std::size_t depth) const {
+    if (n < min_radix_size) {
+      std::stable_sort(keys, keys + n,
+                       [this, depth](const sort_key& lhs,
+                                     const sort_key& rhs) {
+                         auto lhs_name = name_of(lhs.ref);
+                         auto rhs_name = name_of(rhs.ref);
+                         return lhs_name.substr(std::min(depth,
+                                                         lhs_name.size())) <
+                                rhs_name.substr(
+                                    std::min(depth, rhs_name.size()));
+                       });
+      return;
+    }
+    for (auto i = 0ul; i < n; ++i) {
+      keys[i].chunk = name_chunk(name_of(keys[i].ref), depth);
+    }
+    radix_sort(keys, tmp, n);
+    for (auto beg = 0ul; beg < n;) {
+      auto end = beg + 1;
+      while (end < n && keys[end].chunk == keys[beg].chunk) {
+        ++end;
+      }
+      // names that end within the chunk are equal
+      if (end - beg > 1 && (keys[beg].chunk & 0xffu) != 0) {
+        sort_keys(keys + beg, tmp + beg, end - beg, depth + 8);
+      }
+      beg = end;
+    }
+  }
+
+  /** Stable LSD radix sort on chunk, skipping bytes that are all equal. */
+  static void radix_sort(sort_key* keys, sort_key* tmp, std::size_t n) {
+    std::array<std::array<uint32_t, 256>, 8> counts{};
+    for (auto i = 0ul; i < n; ++i) {
+      for (auto b = 0u; b < 8; ++b) {
+        ++counts[b][(keys[i].chunk >> (8u * b)) & 0xffu];
+      }
+    }
+    auto* src = keys;
+    auto* dst = tmp;
+    for (auto b = 0u; b < 8; ++b) {
+      auto& count = counts[b];
+      if (count[(src[0].chunk >> (8u * b)) & 0xffu] == n) {
+        continue;
+      }
+      uint32_t offset = 0;
+      for (auto& c : count) {
+        auto next = offset + c;
+        c = offset;
+        offset = next;
+      }
+      for (auto i = 0ul; i < n; ++i) {
+        dst[count[(src[i].chunk >> (8u * b)) & 0xffu]++] = src[i];
+      }
+      std::swap(src, dst);
+    }
+    if (src != keys) {
+      std::copy(src, src + n, keys);
+    }
+  }
+
+  uint64_t max_bytes_;
+  std::size_t block_size_;
+  std::vector<std::unique_ptr<uint8_t[]>> blocks_;
+  std::size_t block_bytes_ = 0;
+  std::size_t block_used_ = 0;
+  std::vector<record_ref> refs_;
+  std::vector<sort_key> keys_;
+};
+
+name_sorter::name_sorter(uint64_t max_memory, uint64_t threads)
+    : heap_greater_([this](std::size_t lhs, std::size_t rhs) {
+        return source_greater(lhs, rhs);
+      }),
+      run_memory_(max_memory / std::max(1ul, threads)),
+      max_spills_(threads > 1 ? threads - 1 : 0),
+      run_(std::make_unique<run>(run_memory_)) {}
+
+name_sorter::~name_sorter() {
+  for (auto& spill : spills_) {
+    if (spill.valid()) {
+      spill.wait();
+    }
+  }
+  for (auto& source : sources_) {
+    if (source.file != nullptr) {
+      bgzf_close(source.file);
+    }
+  }
+  for (auto& path : paths_) {
+    std::remove(path.c_str());
+  }
+}
+
+void name_sorter::add(const bam1_t* record) {
+  if (run_->full()) {
+    spill_run();
+  }
+  run_->add(record);
+}
+
+std::string name_sorter::temporary_path() {
+  paths_.push_back(temporary_file_path("sort"));
+  return paths_.back();
+}
+
+void name_sorter::spill_run() {
+  auto path = temporary_path();
+  runs_.push_back(path);
+  std::unique_ptr<run> full_run = std::move(run_);
+  run_ = std::make_unique<run>(run_memory_);
+  if (max_spills_ == 0) {
+    full_run->sort();
+    full_run->write(path);
+    return;
+  }
+  // the sorted runs only need to be complete before merging
+  if (spills_.size() >= max_spills_) {
+    wait_for_spill();
+  }
+  spills_.push_back(
+      std::async(std::launch::async, [spilled = std::move(full_run), path]() {
+        spilled->sort();
+        spilled->write(path);
+      }));
+}
+
+void name_sorter::wait_for_spill() {
+  spills_.front().get();
+  spills_.erase(spills_.begin());
+}
+
+bool name_sorter::source_greater(std::size_t lhs, std::size_t rhs) const {
+  // records with equal names are taken from the earlier run first
+  return std::tie(sources_[lhs].name, lhs) > std::tie(sources_[rhs].name, rhs);
+}
+
+void name_sorter::open_sources(std::size_t beg, std::size_t end) {
+  for (auto i = beg; i < end; ++i) {
+    merge_source source;
+    source.file = bgzf_open(runs_[i].c_str(), "r");
+    if (source.file == nullptr) {
+      throw std::runtime_error(
+          fmt::format("Could not open temporary file '{}'", runs_[i]));
+    }
+    source.head.reset(bam_init1());
+    sources_.push_back(std::move(source));
+  }
+}
+
+void name_sorter::start_merge() {
+  for (auto i = 0ul; i < sources_.size(); ++i) {
+    if (advance(sources_[i])) {
+      heap_.push_back(i);
+    }
+  }
+  std::make_heap(heap_.begin(), heap_.end(), heap_greater_);
+}
+
+void name_sorter::close_sources() {
+  for (auto& source : sources_) {
+    if (source.file != nullptr) {
+      bgzf_close(source.file);
+    }
+  }
+  sources_.clear();
+  heap_.clear();
+}
+
+void name_sorter::merge_runs(std::size_t beg,
+                             std::size_t end,
+                             const std::string& path) {
+  BGZF* file = bgzf_open(path.c_str(), "w1");
+  if (file == nullptr) {
+    throw std::runtime_error(
+        fmt::format("Could not open temporary file '{}'", path));
+  }
+  open_sources(beg, end);
+  start_merge();
+  std::unique_ptr<bam1_t, void (*)(bam1_t*)> record(bam_init1(),
+                                                     bam_destroy1);
+  while (next(record.get())) {
+    if (bam_write1(file, record.get()) < 0) {
+      bgzf_close(file);
+      throw std::runtime_error(
+          fmt::format("Could not write to temporary file '{}'", path));
+    }
+  }
+  close_sources();
+  if (bgzf_close(file) != 0) {
+    throw std::runtime_error(
+        fmt::format("Could not write to temporary file '{}'", path));
+  }
+  for (auto i = beg; i < end; ++i) {
+    std::remove(runs_[i].c_str());
+  }
+}
+
+void name_sorter::finish() {
+  while (!spills_.empty()) {
+    wait_for_spill();
+  }
+  // merge consecutive runs in passes until the spilled runs and the last
+  // run fit into a single merge, the merged runs keep their order such that
+  // equal names still come from the earlier run first
+  while (runs_.size() >= max_merge_runs) {
+    std::vector<std::string> merged;
+    for (auto beg = 0ul; beg < runs_.size(); beg += max_merge_runs) {
+      auto end = std::min(beg + max_merge_runs, runs_.size());
+      if (end - beg == 1) {
+        merged.push_back(runs_[beg]);
+        continue;
+      }
+      merged.push_back(temporary_path());
+      merge_runs(beg, end, merged.back());
+    }
+    runs_ = std::move(merged);
+  }
+  open_sources(0, runs_.size());
+  // the last run is merged from memory
+  run_->sort();
+  merge_source last;
+  last.memory = std::move(run_);
+  sources_.push_back(std::move(last));
+  start_merge();
+}
+
+bool name_sorter::advance(merge_source& source) {
+  if (source.memory != nullptr) {
+    if (source.next == source.memory->size()) {
+      return false;
+    }
+    source.name = source.memory->name(source.next);
+    return true;
+  }
+  auto ret = bam_read1(source.file, source.head.get());
+  if (ret < -1) {
+    throw std::runtime_error("Could not read from temporary file!");
+  }
+  if (ret < 0) {
+    return false;
+  }
+  source.name = get_canonical_name(source.head.get());
+  return true;
+}
+
+bool name_sorter::next(bam1_t* record) {
+  if (heap_.empty()) {
+    return false;
+  }
+  std::pop_heap(heap_.begin(), heap_.end(), heap_greater_);
+  auto& source = sources_[heap_.back()];
+  if (source.memory != nullptr) {
+    source.memory->load(source.next++, record);
+  } else {
+    // hand over the record and read the next one into its buffer
+    std::swap(*record, *source.head);
+  }
+  if (advance(source)) {
+    std::push_heap(heap_.begin(), heap_.end(), heap_greater_);
+  } else {
+    heap_.pop_back();
+  }
+  return true;
+}
+
+namespace {
+// number of temporary files the spilled reads are partitioned into
+constexpr std::size_t num_partitions = 64;
+// partitions are split again at most this many times, reads with the same
+// name always end up in the same partition
+constexpr std::size_t max_partition_depth = 3;
+}  // namespace
+
+/**
+ * Alignments of the reads that are not complete yet by canonical name,
+ * with the memory they use.
+ */
+class name_grouper::table {
+ public:
+  using record_ptr = std::unique_ptr<bam1_t, void (*)(bam1_t*)>;
+
+  struct group {
+    std::vector<record_ptr> reads;
+    // alignments of R1, R2 and unpaired reads, expected by their NH tag or
+    // -1 if it is missing
+    std::array<int64_t, 3> seen{};
+    std::array<int64_t, 3> expected{{-1, -1, -1}};
+    // whether an alignment of R1 or R2 has a mapped mate
+    std::array<bool, 2> mate_mapped{};
+
+    bool complete() const {
+      for (auto i = 0ul; i < seen.size(); ++i) {
+        if (seen[i] > 0 && seen[i] != expected[i]) {
+          return false;
+        }
+      }
+      return (!mate_mapped[0] || seen[1] > 0) &&
+             (!mate_mapped[1] || seen[0] > 0);
+    }
+  };
+
+  /** Scratch record to read into. */
+  bam1_t* record() { return record_.get(); }
+
+  uint64_t bytes() const { return bytes_; }
+
+  /** Adds a copy of record to the group of its name and returns the group. */
+  group& add(const bam1_t* record) {
+    auto name = get_canonical_name(record);
+    key_.assign(name.data(), name.size());
+    auto it = groups_.find(key_);
+    if (it == groups_.end()) {
+      it = groups_.emplace(key_, group{}).first;
+      bytes_ += sizeof(std::pair<const std::string, group>) + key_.size();
+    }
+    auto& g = it->second;
+    auto flag = record->core.flag;
+    auto segment = 2ul;
+    if ((flag & BAM_FPAIRED) != 0 && (flag & BAM_FREAD1) != 0) {
+      segment = 0;
+    } else if ((flag & BAM_FPAIRED) != 0 && (flag & BAM_FREAD2) != 0) {
+      segment = 1;
+    }
+    if (g.seen[segment]++ == 0) {
+      const auto* nh = bam_aux_get(record, "NH");
+      g.expected[segment] = nh != nullptr ? bam_aux2i(nh) : -1;
+    }
+    if (segment < 2 && (flag & BAM_FMUNMAP) == 0) {
+      g.mate_mapped[segment] = true;
+    }
+    g.reads.emplace_back(bam_dup1(record), bam_destroy1);
+    bytes_ += sizeof(bam1_t) + sizeof(record_ptr) + g.reads.back()->m_data;
+    return g;
+  }
+
+  /** Moves the alignments of the read added last to out. */
+  void take_last(std::vector<record_ptr>& out) {
+    auto it = groups_.find(key_);
+    take(it->second, out);
+    bytes_ -= sizeof(std::pair<const std::string, group>) + key_.size();
+    groups_.erase(it);
+  }
+
+  /** Moves the alignments of all reads to out. */
+  void take_all(std::vector<record_ptr>& out) {
+    for (auto& entry : groups_) {
+      take(entry.second, out);
+    }
+    groups_.clear();
+    bytes_ = 0;
+  }
+
+  /**
+   * Writes all reads to the partition of their name and removes them. Each
+   * depth partitions the names by a different hash.
+   */
+  void spill(const std::vector<BGZF*>& partitions, std::size_t depth) {
+    for (auto& entry : groups_) {
+      auto hash = robin_hood::hash_int(
+          robin_hood::hash_bytes(entry.first.data(), entry.first.size()) +
+          depth);
+      auto* file = partitions[hash % partitions.size()];
+      for (auto& read : entry.second.reads) {
+        if (bam_write1(file, read.get()) < 0) {
+          throw std::runtime_error("Could not write to temporary file!");
+        }
+      }
+    }
+    groups_.clear();
+    bytes_ = 0;
+  }
+
+ private:
+  void take(group& g, std::vector<record_ptr>& out) {
+    for (auto& read : g.reads) {
+      bytes_ -= sizeof(bam1_t) + sizeof(record_ptr) + read->m_data;
+      out.push_back(std::move(read));
+    }
+  }
+
+  robin_hood::unordered_node_map<std::string, group> groups_;
+  std::string key_;
+  record_ptr record_{bam_init1(), bam_destroy1};
+  uint64_t bytes_ = 0;
+};
+
+name_grouper::name_grouper(std::function<bool(bam1_t*)> read_next,
+                           uint64_t max_memory)
+    : read_next_(std::move(read_next)),
+      max_memory_(max_memory),
+      table_(std::make_unique<table>()) {}
+
+name_grouper::~name_grouper() {
+  for (auto* file : partitions_) {
+    bgzf_close(file);
+  }
+  for (auto& path : paths_) {
+    std::remove(path.c_str());
+  }
+}
+
+bool name_grouper::next(bam1_t* record) {
+  while (next_ready_ == ready_.size()) {
+    ready_.clear();
+    next_ready_ = 0;
+    if (!fill_ready()) {
+      return false;
+    }
+  }
+  // hand over the record instead of copying it
+  std::swap(*record, *ready_[next_ready_++]);
+  return true;
+}
+
+bool name_grouper::fill_ready() {
+  if (!input_done_) {
+    auto* record = table_->record();
+    while (read_next_(record)) {
+      // unmapped mates have no NH tag and are dropped by fix_flags anyway
+      if ((record->core.flag & BAM_FUNMAP) != 0) {
+        continue;
+      }
+      if (table_->add(record).complete()) {
+        table_->take_last(ready_);
+        return true;
+      }
+      if (table_->bytes() > max_memory_) {
+        spill(0);
+      }
+    }
+    input_done_ = true;
+    if (partitions_.empty()) {
+      table_->take_all(ready_);
+      return !ready_.empty();
+    }
+    spill(0);
+    close_partitions(0);
+  }
+
+  // the alignments of a read all end up in the same partition
+  while (next_partition_ < pending_.size()) {
+    auto part = pending_[next_partition_++];
+    BGZF* file = bgzf_open(part.path.c_str(), "r");
+    if (file == nullptr) {
+      throw std::runtime_error(
+          fmt::format("Could not open temporary file '{}'", part.path));
+    }
+    auto* record = table_->record();
+    int ret = 0;
+    while ((ret = bam_read1(file, record)) >= 0) {
+      table_->add(record);
+      // a partition that does not fit is split into partitions again
+      if (table_->bytes() > max_memory_ &&
+          part.depth + 1 < max_partition_depth) {
+        spill(part.depth + 1);
+      }
+    }
+    bgzf_close(file);
+    std::remove(part.path.c_str());
+    if (ret < -1) {
+      throw std::runtime_error("Could not read from temporary file!");
+    }
+    if (!partitions_.empty()) {
+      spill(part.depth + 1);
+      close_partitions(part.depth + 1);
+      continue;
+    }
+    table_->take_all(ready_);
+    if (!ready_.empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void name_grouper::spill(std::size_t depth) {
+  if (partitions_.empty()) {
+    for (auto i = 0ul; i < num_partitions; ++i) {
+      paths_.push_back(temporary_file_path("group"));
+      BGZF* file = bgzf_open(paths_.back().c_str(), "w1");
+      if (file == nullptr) {
+        throw std::runtime_error(
+            fmt::format("Could not open temporary file '{}'", paths_.back()));
+      }
+      partitions_.push_back(file);
+    }
+  }
+  table_->spill(partitions_, depth);
+}
+
+void name_grouper::close_partitions(std::size_t depth) {
+  auto failed = false;
+  for (auto* file : partitions_) {
+    failed = bgzf_close(file) != 0 || failed;
+  }
+  // the partitions are the last files that have been opened
+  for (auto i = paths_.size() - partitions_.size(); i < paths_.size(); ++i) {
+    pending_.push_back({paths_[i], depth});
+  }
+  partitions_.clear();
+  if (failed) {
+    throw std::runtime_error("Could not write to temporary file!");
+  }
+}
+
+}  // namespace fumi_tools
@@ -0,0 +1,1003 @@
+#include <fumi_tools/read_flags.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include <cpg/cpg.hpp>
+#include <fumi_tools/cast_helper.hpp>
+#include <fumi_tools/helper.hpp>
+#include <fumi_tools/name_sort.hpp>
+#include <fumi_tools/spsc_ring.hpp>
+#include <fumi_tools/thread_pool.hpp>
+
+namespace fumi_tools {
+namespace {
+
+void add_flag(bam1_t* b, uint16_t flag) {
+  b->core.flag |= flag;
+}
+
+void remove_flag(bam1_t* b, uint16_t flag) {
+  b->core.flag &= ~flag;
+}
+
+using bam1_ptr = std::unique_ptr<bam1_t, bam1_t_deleter>;
+
+/**
+ * Alignment of a read with the offsets of the tags used to fix the flags and
+ * the key the alignments of a read are ordered by. Both are computed once per
+ * alignment instead of looking up the tags in every comparison.
+ */
+struct indexed_read {
+  bam1_t* read = nullptr;
+  // !is_r1, !is_r2, then tid, pos, template length and HI of the first read
+  std::array<int64_t, 6> key{};
+  // offsets of the tag types within the record data, -1 if missing
+  int32_t hi = -1;
+  int32_t nh = -1;
+  int32_t as = -1;
+  int32_t xs = -1;
+};
+
+/** Size of an aux value of the given type, 0 if it has a variable size. */
+std::size_t aux_value_size(uint8_t type) {
+  switch (type) {
+    case 'A':
+    case 'c':
+    case 'C':
+      return 1;
+    case 's':
+    case 'S':
+      return 2;
+    case 'i':
+    case 'I':
+    case 'f':
+      return 4;
+    case 'd':
+      return 8;
+    default:
+      return 0;
+  }
+}
+
+/** Finds the first HI, NH, AS and XS tag in a single pass over the aux data. */
+void index_tags(indexed_read& r) {
+  r.hi = r.nh = r.as = r.xs = -1;
+  auto* data = r.read->data;
+  auto* s = bam_get_aux(r.read);
+  auto* end = data + r.read->l_data;
+  while (end - s >= 3) {
+    int32_t* offset = nullptr;
+    if (s[0] == 'H' && s[1] == 'I') {
+      offset = &r.hi;
+    } else if (s[0] == 'N' && s[1] == 'H') {
+      offset = &r.nh;
+    } else if (s[0] == 'A' && s[1] == 'S') {
+      offset = &r.as;
+    } else if (s[0] == 'X' && s[1] == 'S') {
+      offset = &r.xs;
+    }
+    if (offset != nullptr && *offset < 0) {
+      *offset = static_cast<int32_t>(s + 2 - data);
+    }
+    auto type = s[2];
+    s += 3;
+    if (type == 'Z' || type == 'H') {
+      auto* nul = static_cast<uint8_t*>(
+          std::memchr(s, '\0', static_cast<std::size_t>(end - s)));
+      if (nul == nullptr) {
+        break;
+      }
+      s = nul + 1;
+    } else if (type == 'B') {
+      if (end - s < 5) {
+        break;
+      }
+      uint32_t count = 0;
+      std::memcpy(&count, s + 1, sizeof(count));
+      s += 5 + count * aux_value_size(s[0]);
+    } else if (aux_value_size(type) > 0) {
+      s += aux_value_size(type);
+    } else {
+      break;
+    }
+  }
+}
+
+/** Integer value of the tag at offset, 0 if the tag is missing. */
+int64_t aux_int(const indexed_read& r, int32_t offset) {
+  return offset < 0 ? 0 : bam_aux2i(r.read->data + offset);
+}
+
+void index_read(indexed_read& r, bool has_hi) {
+  index_tags(r);
+  const auto& core = r.read->core;
+  auto is_r1 = (core.flag & BAM_FREAD1) != 0;
+  auto is_r2 = (core.flag & BAM_FREAD2) != 0;
+  // second reads are ordered by the alignment of their mate
+  auto mate = !is_r1 && is_r2;
+  r.key = {!is_r1,
+           !is_r2,
+           mate ? core.mtid : core.tid,
+           mate ? core.mpos : core.pos,
+           mate ? -core.isize : core.isize,
+           has_hi ? aux_int(r, r.hi) : 0};
+}
+
+/** Compares the alignments without the flag info of their keys. */
+bool aln_less(const indexed_read& lhs, const indexed_read& rhs) {
+  return std::lexicographical_compare(lhs.key.begin() + 2, lhs.key.end(),
+                                      rhs.key.begin() + 2, rhs.key.end());
+}
+
+/**
+ * Rewrites an integer tag in place if the value fits the width of the tag,
+ * choosing the type like bam_aux_update_int does when it reuses the space
+ * of the old value. Returns false if the record would need to be resized.
+ */
+bool update_int_in_place(bam1_t* read, int32_t offset, int64_t val) {
+  if (offset < 0) {
+    return false;
+  }
+  auto* s = read->data + offset;
+  std::size_t size = 0;
+  if (val < INT16_MIN) {
+    size = 4;
+  } else if (val < INT8_MIN) {
+    size = 2;
+  } else if (val < 0) {
+    size = 1;
+  } else if (val < UINT8_MAX) {
+    size = 1;
+  } else if (val < UINT16_MAX) {
+    size = 2;
+  } else {
+    size = 4;
+  }
+  auto old_size = aux_value_size(*s);
+  if (*s == 'A' || *s == 'f' || *s == 'd' || old_size < size ||
+      val < INT32_MIN || val > UINT32_MAX) {
+    return false;
+  }
+  switch (old_size) {
+    case 1: {
+      s[0] = val < 0 ? 'c' : 'C';
+      auto v = static_cast<uint8_t>(val);
+      std::memcpy(s + 1, &v, sizeof(v));
+      break;
+    }
+    case 2: {
+      s[0] = val < 0 ? 's' : 'S';
+      auto v = static_cast<uint16_t>(val);
+      std::memcpy(s + 1, &v, sizeof(v));
+      break;
+    }
+    default: {
+      s[0] = val < 0 ? 'i' : 'I';
+      auto v = static_cast<uint32_t>(val);
+      std::memcpy(s + 1, &v, sizeof(v));
+      break;
+    }
+  }
+  return true;
+}
+
+/** Sets an integer tag, the offsets are updated if the record is resized. */
+void update_int(indexed_read& r,
+                int32_t indexed_read::*offset,
+                const char tag[2],
+                int64_t val) {
+  if (!update_int_in_place(r.read, r.*offset, val)) {
+    bam_aux_update_int(r.read, tag, val);
+    index_tags(r);
+  }
+}
+
+struct mapq_stats {
+  std::size_t num_r1_reads = 0;
+  std::size_t num_r2_reads = 0;
+  std::size_t num_other_reads = 0;
+  int32_t best_r1_i = -1;
+  int32_t best_r2_i = -1;
+  int32_t best_other_i = -1;
+};
+
+mapq_stats get_best_mapq(const std::vector<indexed_read>& reads) {
+  mapq_stats result{};
+
+  auto best_mapq_r1 = std::numeric_limits<int32_t>::min();
+  auto best_mapq_r2 = std::numeric_limits<int32_t>::min();
+  auto best_mapq_other = std::numeric_limits<int32_t>::min();
+
+  for (auto i = 0ul; i < reads.size(); ++i) {
+    auto qual = reads[i].read->core.qual;
+    if ((reads[i].read->core.flag & BAM_FREAD1) != 0) {
+      ++result.num_r1_reads;
+      if (qual > best_mapq_r1) {
+        best_mapq_r1 = qual;
+        result.best_r1_i = i;
+      }
+    } else if ((reads[i].read->core.flag & BAM_FREAD2) != 0) {
+      ++result.num_r2_reads;
+      if (qual > best_mapq_r2) {
+        best_mapq_r2 = qual;
+        result.best_r2_i = i;
+      }
+    } else {
+      ++result.num_other_reads;
+      if (qual > best_mapq_other) {
+        best_mapq_other = qual;
+        result.best_other_i = i;
+      }
+    }
+  }
+  return result;
+}
+
+std::array<int64_t, 3> get_second_best_as(
+    const std::vector<indexed_read>& reads,
+    const mapq_stats& stats) {
+  auto has_as = reads[0].as >= 0;
+  auto second_best_as = [&](std::size_t num_reads, std::size_t first) {
+    if (num_reads == 0 || !has_as) {
+      return -1l;
+    }
+    auto& r = reads[num_reads == 1 ? first : first + 1];
+    return aux_int(r, r.as);
+  };
+  return {second_best_as(stats.num_r1_reads, 0),
+          second_best_as(stats.num_r2_reads, stats.num_r1_reads),
+          second_best_as(stats.num_other_reads,
+                         stats.num_r1_reads + stats.num_r2_reads)};
+}
+
+std::size_t set_primary_alignment(const std::vector<indexed_read>& reads,
+                                  const mapq_stats& stats) {
+  std::size_t distinct_alignments = 0;
+  std::size_t r1_idx = 0;
+  auto r2_idx = stats.num_r1_reads;
+  while (r1_idx < stats.num_r1_reads ||
+         r2_idx < stats.num_r1_reads + stats.num_r2_reads) {
+    const indexed_read* r1 = nullptr;
+    const indexed_read* r2 = nullptr;
+    if (r1_idx < stats.num_r1_reads) {
+      r1 = &reads[r1_idx];
+    }
+
+    if (r2_idx < stats.num_r1_reads + stats.num_r2_reads) {
+      r2 = &reads[r2_idx];
+    }
+
+    if (r1 != nullptr && (r2 == nullptr || aln_less(*r1, *r2))) {
+      ++r1_idx;
+      ++distinct_alignments;
+      if (stats.best_r1_i >= 0) {
+        if (r1_idx == as_unsigned(stats.best_r1_i)) {
+          remove_flag(r1->read, BAM_FSECONDARY);
+        } else {
+          add_flag(r1->read, BAM_FSECONDARY);
+        }
+      }
+    } else if (r2 != nullptr && (r1 == nullptr || aln_less(*r2, *r1))) {
+      ++distinct_alignments;
+      ++r2_idx;
+      add_flag(r2->read, BAM_FSECONDARY);
+    } else {
+      ++distinct_alignments;
+      if (r1_idx == as_unsigned(stats.best_r1_i)) {
+        remove_flag(r1->read, BAM_FSECONDARY);
+        remove_flag(r2->read, BAM_FSECONDARY);
+      } else {
+        add_flag(r1->read, BAM_FSECONDARY);
+        add_flag(r2->read, BAM_FSECONDARY);
+      }
+      ++r1_idx;
+      ++r2_idx;
+    }
+  }
+
+  // if we don't have any r1, r2 reads there can only be 1 primary alignment
+  for (std::size_t i = stats.num_r1_reads + stats.num_r2_reads;
+       i < reads.size(); ++i) {
+    if (stats.best_r1_i == -1 && stats.best_r2_i == -1 &&
+        stats.best_other_i >= 0) {
+      if (i == as_unsigned(stats.best_other_i)) {
+        remove_flag(reads[i].read, BAM_FSECONDARY);
+      } else {
+        add_flag(reads[i].read, BAM_FSECONDARY);
+      }
+    }
+  }
+
+  distinct_alignments += stats.num_other_reads;
+  return distinct_alignments;
+}
+
+void update_xs_nh_hi_fields(std::vector<indexed_read>& reads,
+                            const mapq_stats& stats,
+                            std::size_t distinct_alignments,
+                            std::array<int64_t, 3>& second_best_as) {
+  auto has_xs = reads[0].xs >= 0;
+  auto has_as = reads[0].as >= 0;
+  auto has_nh = reads[0].nh >= 0;
+  // update second best alignment score (XS), number of hits (NH) and hit index
+  // (HI) fields
+  for (auto i = 0ul; i < reads.size(); ++i) {
+    auto& r = reads[i];
+    auto is_r1 = (r.read->core.flag & BAM_FREAD1) != 0;
+    auto is_r2 = (r.read->core.flag & BAM_FREAD2) != 0;
+    if (has_nh) {
+      update_int(r, &indexed_read::nh, "NH", as_signed(distinct_alignments));
+      if (is_r1) {
+        update_int(r, &indexed_read::hi, "HI", as_signed(i + 1));
+      } else if (is_r2) {
+        update_int(r, &indexed_read::hi, "HI",
+                   as_signed(i + 1 - stats.num_r1_reads));
+      } else {
+        update_int(
+            r, &indexed_read::hi, "HI",
+            as_signed(i + 1 - stats.num_r1_reads - stats.num_r2_reads));
+      }
+    }
+    if (has_as && has_xs) {
+      update_int(r, &indexed_read::xs, "XS",
+                 second_best_as[is_r1 ? 0 : is_r2 ? 1 : 2]);
+    }
+  }
+}
+
+/**
+ * Quick path for a read with a single alignment, which becomes its primary
+ * alignment. With in_place, tags that would need to grow are left alone and
+ * false is returned.
+ */
+bool fix_single_alignment(indexed_read& r, bool in_place) {
+  auto update = [&r, in_place](int32_t indexed_read::*offset,
+                               const char tag[2], int64_t val) {
+    if (in_place) {
+      return update_int_in_place(r.read, r.*offset, val);
+    }
+    update_int(r, offset, tag, val);
+    return true;
+  };
+
+  // set primary aln
+  remove_flag(r.read, BAM_FSECONDARY);
+
+  if (r.as >= 0 && r.xs >= 0) {
+    // second best aln score is self
+    auto as = aux_int(r, r.as);
+    if (as != aux_int(r, r.xs) && !update(&indexed_read::xs, "XS", as)) {
+      return false;
+    }
+  }
+  if (r.nh >= 0) {
+    if (aux_int(r, r.nh) != 1 && !update(&indexed_read::nh, "NH", 1)) {
+      return false;
+    }
+    if (r.hi >= 0 && aux_int(r, r.hi) != 1 &&
+        !update(&indexed_read::hi, "HI", 1)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool get_pattern_code(uint32_t flag) {
+  if ((flag & BAM_FREAD1) != 0)
+    return (flag & BAM_FREVERSE) != 0;
+  else
+    return (flag & BAM_FREVERSE) == 0;
+}
+
+void write_reads(const std::vector<bam1_ptr>& reads,
+                 bam_hdr_t* bam_hdr,
+                 samFile* outfile) {
+  for (auto& r : reads) {
+    if (sam_write1(outfile, bam_hdr, r.get()) < 0) {
+      std::cerr << "Failed to write to output file!" << std::endl;
+      std::exit(1);
+    }
+  }
+}
+
+/**
+ * Fixes the flags of the alignments of a single read and puts them into
+ * output order. Only touches the given reads, so groups can be fixed on
+ * several threads with a fixer each. The tags of each alignment are indexed
+ * once per group.
+ */
+class read_group_fixer {
+ public:
+  void operator()(std::vector<bam1_ptr>& reads, bool rsem_sort) {
+    if (reads.empty()) {
+      return;
+    }
+
+    // use the mapping quality to determine which alignment should be the
+    // primary alignment
+    // collect second best alignment score, if available, to update the XS
+    // tag accordingly
+    indexed_.resize(reads.size());
+    for (auto i = 0ul; i < reads.size(); ++i) {
+      indexed_[i].read = reads[i].get();
+      index_tags(indexed_[i]);
+    }
+    auto has_hi = indexed_[0].hi >= 0;
+
+    // quick path
+    if (reads.size() == 1) {
+      fix_single_alignment(indexed_[0], false);
+      return;
+    }
+
+    // order so that we have first r1, then r2, then unpaired
+    // r1 and r2 ordered the same way such that if they are paired they come
+    // in the same order possibility 1: only r1 without paired mate 2: only r2
+    // without paired mate 3: r1 & r2 paired 4: not paired
+    for (auto& r : indexed_) {
+      index_read(r, has_hi);
+    }
+    std::stable_sort(indexed_.begin(), indexed_.end(),
+                     [](const auto& lhs, const auto& rhs) {
+                       return lhs.key < rhs.key;
+                     });
+    for (auto i = 0ul; i < reads.size(); ++i) {
+      reads[i].release();
+    }
+    for (auto i = 0ul; i < reads.size(); ++i) {
+      reads[i].reset(indexed_[i].read);
+    }
+
+    // get best mapping qualities for r1, r2 and rest
+    auto mapq_stats = get_best_mapq(indexed_);
+    auto second_best_as = get_second_best_as(indexed_, mapq_stats);
+
+    auto distinct_alignments = set_primary_alignment(indexed_, mapq_stats);
+    update_xs_nh_hi_fields(indexed_, mapq_stats, distinct_alignments,
+                           second_best_as);
+
+    if (rsem_sort) {
+      auto rsem_less = [](const auto& lhs, const auto& rhs) {
+        auto lhsp = std::minmax(lhs->core.pos, lhs->core.mpos);
+        auto rhsp = std::minmax(rhs->core.pos, rhs->core.mpos);
+        auto lhspat = get_pattern_code(lhs->core.flag);
+        auto rhspat = get_pattern_code(rhs->core.flag);
+
+        if (lhs->core.tid != rhs->core.tid) {
+          return lhs->core.tid < rhs->core.tid;
+        }
+        if (lhsp.first != rhsp.first) {
+          return lhsp.first < rhsp.first;
+        }
+        if (lhsp.second != rhsp.second) {
+          return lhsp.second < rhsp.second;
+        }
+        return lhspat < rhspat;
+      };
+      std::sort(reads.begin(), reads.end(), rsem_less);
+    } else {
+      auto samtools_less = [](const auto& lhs, const auto& rhs) {
+        return (lhs->core.flag & 0xc0) < (rhs->core.flag & 0xc0);
+      };
+      std::sort(reads.begin(), reads.end(), samtools_less);
+    }
+  }
+
+ private:
+  std::vector<indexed_read> indexed_;
+};
+
+constexpr std::size_t batch_reads = 4096;
+
+/**
+ * Consecutive name groups, passed from the reading thread to a worker and on
+ * to the writing thread. Only the first size groups are in use, the others
+ * are kept to reuse their vectors.
+ */
+struct group_batch {
+  std::vector<std::vector<bam1_ptr>> groups;
+  std::size_t size = 0;
+};
+
+/**
+ * Fixes the flags of the name groups in a pipeline: the calling thread reads
+ * the groups, workers fix batches of groups and another thread writes them.
+ * The batches are distributed round robin over the workers and collected in
+ * the same order, so the output is the same as fixing them one by one.
+ * Reading and writing take two of the given threads, the others fix flags.
+ */
+void fix_read_flags_parallel(const std::function<bool(bam1_t*)>& read_next,
+                             bam_hdr_t* bam_hdr,
+                             bool sort_rsem,
+                             samFile* outfile,
+                             uint64_t threads,
+                             cpg::cpg& progress) {
+  constexpr std::size_t ring_capacity = 4;
+  // reading and writing take one thread each
+  std::size_t num_workers = threads - 2;
+
+  std::vector<std::unique_ptr<spsc_ring<group_batch>>> read;
+  std::vector<std::unique_ptr<spsc_ring<group_batch>>> fixed;
+  for (auto i = 0ul; i < num_workers; ++i) {
+    read.push_back(std::make_unique<spsc_ring<group_batch>>(ring_capacity));
+    fixed.push_back(std::make_unique<spsc_ring<group_batch>>(ring_capacity));
+  }
+  // large enough to hold all batches, so returning a batch never waits
+  spsc_ring<group_batch> free_batches((2 * ring_capacity + 2) * num_workers +
+                                      2);
+
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  auto fail = [&]() {
+    std::lock_guard<std::mutex> lock(error_mutex);
+    if (!error) {
+      error = std::current_exception();
+    }
+    for (auto i = 0ul; i < num_workers; ++i) {
+      read[i]->close();
+      fixed[i]->close();
+    }
+    free_batches.close();
+  };
+
+  std::vector<std::thread> workers;
+  for (auto w = 0ul; w < num_workers; ++w) {
+    workers.emplace_back([&, w]() {
+      try {
+        read_group_fixer fix_read_group;
+        group_batch batch;
+        while (read[w]->pop(batch)) {
+          for (auto i = 0ul; i < batch.size; ++i) {
+            fix_read_group(batch.groups[i], sort_rsem);
+          }
+          if (!fixed[w]->push(std::move(batch))) {
+            break;
+          }
+        }
+        fixed[w]->close();
+      } catch (...) {
+        fail();
+      }
+    });
+  }
+  std::thread writer([&]() {
+    try {
+      group_batch batch;
+      for (auto i = 0ul; fixed[i % num_workers]->pop(batch); ++i) {
+        for (auto g = 0ul; g < batch.size; ++g) {
+          write_reads(batch.groups[g], bam_hdr, outfile);
+        }
+        free_batches.push(std::move(batch));
+      }
+    } catch (...) {
+      fail();
+    }
+  });
+
+  try {
+    std::string last_qname;
+    group_batch batch;
+    std::size_t num_reads = 0;
+    bam1_t* record = bam_init1();
+    auto next_batch = [&](std::size_t i) {
+      auto pushed = read[i % num_workers]->push(std::move(batch));
+      batch = group_batch{};
+      free_batches.try_pop(batch);
+      batch.size = 0;
+      num_reads = 0;
+      return pushed;
+    };
+    auto i = 0ul;
+    while (read_next(record)) {
+      progress.update();
+      if ((record->core.flag & BAM_FUNMAP) != 0) {
+        continue;
+      }
+      auto qname = get_canonical_name(record);
+      if (batch.size == 0 || qname != last_qname) {
+        // batches only end at the start of a new group
+        if (num_reads >= batch_reads && !next_batch(i++)) {
+          break;
+        }
+        if (batch.size == batch.groups.size()) {
+          batch.groups.emplace_back();
+        }
+        batch.groups[batch.size++].clear();
+        last_qname.assign(qname.begin(), qname.end());
+      }
+      batch.groups[batch.size - 1].emplace_back(bam_dup1(record));
+      ++num_reads;
+    }
+    if (batch.size > 0) {
+      next_batch(i);
+    }
+    bam_destroy1(record);
+    for (auto& ring : read) {
+      ring->close();
+    }
+  } catch (...) {
+    fail();
+  }
+  for (auto& w : workers) {
+    w.join();
+  }
+  writer.join();
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+/**
+ * Reads all mapped reads of infile into sorter and sorts them by name.
+ */
+void sort_by_name(samFile* infile, bam_hdr_t* bam_hdr, name_sorter& sorter) {
+  cpg::cpg_cfg prog_cfg{};
+  prog_cfg.unit = "aln";
+  prog_cfg.unit_scale = true;
+  prog_cfg.mininterval = 3;
+  prog_cfg.desc = "Sort by name";
+
+  auto progress = cpg::cpg(prog_cfg);
+
+  bam1_t* record = bam_init1();
+  while (sam_read1(infile, bam_hdr, record) > 0) {
+    // unmapped reads are dropped by fix_flags anyway
+    if ((record->core.flag & BAM_FUNMAP) == 0) {
+      sorter.add(record);
+    }
+    progress.update();
+  }
+  bam_destroy1(record);
+  sorter.finish();
+}
+
+// size of the fixed fields of a BAM record, which follow its block_size
+constexpr uint32_t raw_core_size = 32;
+// offset of the flag within a raw record, starting at its block_size
+constexpr std::size_t raw_flag_offset = 18;
+
+/** Whether the records of file can be copied without decoding them. */
+bool has_raw_records(htsFile* file) {
+  return __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ &&
+         hts_get_format(file)->format == bam;
+}
+
+/**
+ * Consecutive raw BAM records, each starting with its block_size, read
+ * without decoding them.
+ */
+class raw_records {
+ public:
+  /** Appends the next record of fp, returns false at the end of the file. */
+  bool read(BGZF* fp) {
+    uint32_t block_len = 0;
+    auto ret = bgzf_read(fp, &block_len, sizeof(block_len));
+    if (ret == 0) {
+      return false;
+    }
+    if (ret != sizeof(block_len) || block_len < raw_core_size) {
+      throw std::runtime_error("Could not read BAM record from input file!");
+    }
+    auto start = bytes_;
+    reserve(start + sizeof(block_len) + block_len);
+    std::memcpy(data_.get() + start, &block_len, sizeof(block_len));
+    if (bgzf_read(fp, data_.get() + start + sizeof(block_len), block_len) !=
+        static_cast<ssize_t>(block_len)) {
+      throw std::runtime_error("Could not read BAM record from input file!");
+    }
+    starts_.push_back(start);
+    bytes_ = start + sizeof(block_len) + block_len;
+    return true;
+  }
+
+  void pop_back() {
+    bytes_ = starts_.back();
+    starts_.pop_back();
+  }
+
+  /** Drops the first count records. */
+  void erase_front(std::size_t count) {
+    auto offset = count < starts_.size() ? starts_[count] : bytes_;
+    std::memmove(data_.get(), data_.get() + offset, bytes_ - offset);
+    starts_.erase(starts_.begin(), starts_.begin() + count);
+    for (auto& start : starts_) {
+      start -= offset;
+    }
+    bytes_ -= offset;
+  }
+
+  uint8_t* record(std::size_t i) { return data_.get() + starts_[i]; }
+
+  /** Size of record i including its block_size. */
+  std::size_t record_bytes(std::size_t i) const {
+    return (i + 1 < starts_.size() ? starts_[i + 1] : bytes_) - starts_[i];
+  }
+
+  std::size_t size() const { return starts_.size(); }
+
+ private:
+  void reserve(std::size_t bytes) {
+    if (bytes <= capacity_) {
+      return;
+    }
+    auto capacity = std::max(bytes, 2 * capacity_);
+    std::unique_ptr<uint8_t[]> data(new uint8_t[capacity]);
+    std::memcpy(data.get(), data_.get(), bytes_);
+    data_ = std::move(data);
+    capacity_ = capacity;
+  }
+
+  std::unique_ptr<uint8_t[]> data_;
+  std::size_t capacity_ = 0;
+  std::size_t bytes_ = 0;
+  std::vector<std::size_t> starts_;
+};
+
+/**
+ * Points view to a raw record without copying it. The read name of the view
+ * is not padded, so only its flag and integer tags may be changed in place.
+ */
+void view_raw_record(uint8_t* raw, bam1_t& view) {
+  uint32_t block_len = 0;
+  std::array<uint32_t, 8> x{};
+  std::memcpy(&block_len, raw, sizeof(block_len));
+  std::memcpy(x.data(), raw + sizeof(block_len), sizeof(x));
+  auto& core = view.core;
+  core.tid = static_cast<int32_t>(x[0]);
+  core.pos = static_cast<int32_t>(x[1]);
+  core.bin = static_cast<uint16_t>(x[2] >> 16u);
+  core.qual = static_cast<uint8_t>(x[2] >> 8u & 0xffu);
+  core.l_qname = static_cast<uint8_t>(x[2] & 0xffu);
+  core.l_extranul = 0;
+  core.flag = static_cast<uint16_t>(x[3] >> 16u);
+  core.n_cigar = x[3] & 0xffffu;
+  core.l_qseq = static_cast<int32_t>(x[4]);
+  core.mtid = static_cast<int32_t>(x[5]);
+  core.mpos = static_cast<int32_t>(x[6]);
+  core.isize = static_cast<int32_t>(x[7]);
+  view.data = raw + sizeof(block_len) + raw_core_size;
+  view.l_data = static_cast<int>(block_len - raw_core_size);
+  view.m_data = block_len - raw_core_size;
+}
+
+/** Copies a view into record, padding the read name like bam_read1 does. */
+void decode_raw_record(const bam1_t& view, bam1_t* record) {
+  uint32_t l_qname = view.core.l_qname;
+  uint32_t extranul = l_qname % 4 != 0 ? 4 - l_qname % 4 : 0;
+  if (l_qname + extranul > 255) {
+    extranul = 0;
+  }
+  auto l_data = static_cast<uint32_t>(view.l_data) + extranul;
+  if (record->m_data < l_data) {
+    auto* data = static_cast<uint8_t*>(std::realloc(record->data, l_data));
+    if (data == nullptr) {
+      throw std::bad_alloc();
+    }
+    record->data = data;
+    record->m_data = l_data;
+  }
+  record->core = view.core;
+  record->core.l_qname = static_cast<uint8_t>(l_qname + extranul);
+  record->core.l_extranul = static_cast<uint8_t>(extranul);
+  record->l_data = static_cast<int>(l_data);
+  std::memcpy(record->data, view.data, l_qname);
+  std::memset(record->data + l_qname, 0, extranul);
+  std::memcpy(record->data + l_qname + extranul, view.data + l_qname,
+              static_cast<std::size_t>(view.l_data) - l_qname);
+}
+
+/**
+ * Fixes the flags of a BAM file without decoding the reads with a single
+ * alignment: their flag and tags are patched in the raw record, which is
+ * appended to the output as it is. Reads with several alignments, or whose
+ * tags need to grow, are decoded and fixed like in fix_read_flags.
+ */
+void fix_raw_read_flags(samFile* infile,
+                        bam_hdr_t* bam_hdr,
+                        bool sort_rsem,
+                        samFile* outfile) {
+  cpg::cpg_cfg prog_cfg{};
+  prog_cfg.unit = "aln";
+  prog_cfg.unit_scale = true;
+  prog_cfg.mininterval = 3;
+  prog_cfg.desc = "Fix flags";
+
+  auto progress = cpg::cpg(prog_cfg);
+
+  auto* in = hts_get_bgzfp(infile);
+  auto* out = hts_get_bgzfp(outfile);
+  raw_records group;
+  bam1_t view{};
+  std::vector<bam1_ptr> reads;
+  read_group_fixer fix_read_group;
+
+  // fixes and writes the first count records of group
+  auto fix_group = [&](std::size_t count) {
+    if (count == 1) {
+      auto* raw = group.record(0);
+      view_raw_record(raw, view);
+      indexed_read r;
+      r.read = &view;
+      index_tags(r);
+      auto in_place = fix_single_alignment(r, true);
+      std::memcpy(raw + raw_flag_offset, &view.core.flag,
+                  sizeof(view.core.flag));
+      if (in_place) {
+        if (bgzf_write(out, raw, group.record_bytes(0)) < 0) {
+          std::cerr << "Failed to write to output file!" << std::endl;
+          std::exit(1);
+        }
+        return;
+      }
+    }
+    for (auto i = 0ul; i < count; ++i) {
+      view_raw_record(group.record(i), view);
+      reads.emplace_back(bam_init1());
+      decode_raw_record(view, reads.back().get());
+    }
+    fix_read_group(reads, sort_rsem);
+    write_reads(reads, bam_hdr, outfile);
+    reads.clear();
+  };
+
+  std::string last_qname;
+  while (group.read(in)) {
+    progress.update();
+    view_raw_record(group.record(group.size() - 1), view);
+    if ((view.core.flag & BAM_FUNMAP) != 0) {
+      group.pop_back();
+      continue;
+    }
+    auto qname = get_canonical_name(&view);
+    if (qname != last_qname) {
+      last_qname.assign(qname.begin(), qname.end());
+      if (group.size() > 1) {
+        fix_group(group.size() - 1);
+        group.erase_front(group.size() - 1);
+      }
+    }
+  }
+  if (group.size() > 0) {
+    fix_group(group.size());
+  }
+}
+
+}  // namespace
+
+void fix_read_flags(const std::function<bool(bam1_t*)>& read_next,
+                    bam_hdr_t* bam_hdr,
+                    bool sort_rsem,
+                    samFile* outfile,
+                    uint64_t threads) {
+  cpg::cpg_cfg prog_cfg{};
+  prog_cfg.unit = "aln";
+  prog_cfg.unit_scale = true;
+  prog_cfg.mininterval = 3;
+  prog_cfg.desc = "Fix flags";
+
+  auto progress = cpg::cpg(prog_cfg);
+
+  // the pipeline needs a worker besides the reading and the writing thread
+  if (threads > 2) {
+    fix_read_flags_parallel(read_next, bam_hdr, sort_rsem, outfile, threads,
+                            progress);
+    return;
+  }
+
+  std::vector<bam1_ptr> reads;
+  read_group_fixer fix_read_group;
+
+  std::string last_qname;
+  bam1_t* record = bam_init1();
+  while (read_next(record)) {
+    if ((record->core.flag & BAM_FUNMAP) == 0) {
+      auto qname = get_canonical_name(record);
+      if (qname != last_qname) {
+        // fix flags for this chunk of reads and output them
+        fix_read_group(reads, sort_rsem);
+        write_reads(reads, bam_hdr, outfile);
+        reads.clear();
+        last_qname.assign(qname.begin(), qname.end());
+      }
+      reads.emplace_back(bam_dup1(record));
+    }
+    progress.update();
+  }
+  fix_read_group(reads, sort_rsem);
+  write_reads(reads, bam_hdr, outfile);
+  bam_destroy1(record);
+}
+
+void fix_flags(const std::string& input,
+               const std::string& output,
+               bool sort_rsem,
+               bool name_sort,
+               bool unsorted,
+               uint64_t max_memory,
+               uint64_t threads,
+               uint64_t ithreads,
+               uint64_t othreads,
+               bool copy_raw) {
+  // input and output share one pool, with name_sort all of its threads
+  // decompress while sorting and compress while writing the fixed reads
+  hts_thread_pool io_pool(std::max(ithreads, othreads));
+
+  samFile* file = hts_open(input.c_str(), "r");
+
+  if (file == nullptr) {
+    throw std::runtime_error(fmt::format("Could not open file '{}'", input));
+  }
+
+  io_pool.attach(file);
+
+  // read header
+  bam_hdr_t* bam_hdr = sam_hdr_read(file);
+
+  samFile* out =
+      hts_open(output.c_str(), ends_with(output, ".bam") ? "wb" : "w");
+  if (out == nullptr) {
+    throw std::runtime_error(fmt::format("Could not open file '{}'", output));
+  }
+
+  io_pool.attach(out);
+
+  if (name_sort) {
+    set_sort_order(bam_hdr, "queryname", "lexicographical");
+  } else if (unsorted) {
+    // reads are written in the order they are complete
+    set_sort_order(bam_hdr, "unsorted");
+  }
+
+  if (sam_hdr_write(out, bam_hdr) < -1) {
+    throw std::runtime_error(
+        fmt::format("Could not write header to file '{}'", output));
+  }
+
+  if (name_sort) {
+    name_sorter sorter(max_memory, threads);
+    sort_by_name(file, bam_hdr, sorter);
+    fix_read_flags(
+        [&sorter](bam1_t* record) { return sorter.next(record); }, bam_hdr,
+        sort_rsem, out, threads);
+  } else if (unsorted) {
+    name_grouper grouper(
+        [file, bam_hdr](bam1_t* record) {
+          return sam_read1(file, bam_hdr, record) > 0;
+        },
+        max_memory);
+    fix_read_flags(
+        [&grouper](bam1_t* record) { return grouper.next(record); }, bam_hdr,
+        sort_rsem, out, threads);
+  } else if (copy_raw && threads <= 1 && has_raw_records(file) &&
+             has_raw_records(out)) {
+    fix_raw_read_flags(file, bam_hdr, sort_rsem, out);
+  } else {
+    fix_read_flags(
+        [file, bam_hdr](bam1_t* record) {
+          return sam_read1(file, bam_hdr, record) > 0;
+        },
+        bam_hdr, sort_rsem, out, threads);
+  }
+
+  bam_hdr_destroy(bam_hdr);
+
+  hts_close(file);
+  hts_close(out);
+}
+}  // namespace fumi_tools
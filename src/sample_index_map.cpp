@@ -13,6 +13,10 @@
 #include <rapidcsv/rapidcsv.h>
 
 namespace {
+/**
+ * Character loop for sequences that cannot be packed, packed sequences are
+ * compared with hamming_distance instead.
+ */
 uint64_t get_num_mismatches(nonstd::string_view lhs, nonstd::string_view rhs) {
   auto num_mismatches = 0ul;
   for (auto i = 0ul; i < lhs.size(); ++i) {
@@ -262,12 +266,35 @@ sample_index_map::sample_index_map(const std::string& sample_sheet,
     }
   }
 
+  // the hamming kernels are only used if all indices of a lane can be packed
+  auto pack_indices = [](const auto& indices, auto& packed) {
+    packed.resize(indices.size());
+    for (auto i = 0ul; i < indices.size(); ++i) {
+      packed_sequence seq;
+      for (auto& index : indices[i]) {
+        if (!pack_sequence(index, seq)) {
+          packed[i].clear();
+          break;
+        }
+        packed[i].push_back(seq);
+      }
+    }
+  };
+  pack_indices(i7_indices_, i7_packed_);
+  pack_indices(i5_indices_, i5_packed_);
+
   // check if we have ambiguous indices when considering mismatches
   for (auto i = 0ul; i < i7_indices_.size(); ++i) {
-    for (auto& i7 : i7_indices_[i]) {
-      for (auto& other_i7 : i7_indices_[i]) {
-        if (i7 != other_i7 &&
-            get_num_mismatches(i7, other_i7) <= 2 * max_errors_) {
+    auto& packed = i7_packed_[i];
+    auto is_packed = packed.size() == i7_indices_[i].size();
+    for (auto j = 0ul; j < i7_indices_[i].size(); ++j) {
+      for (auto k = 0ul; k < i7_indices_[i].size(); ++k) {
+        auto& i7 = i7_indices_[i][j];
+        auto& other_i7 = i7_indices_[i][k];
+        auto num_mismatches =
+            is_packed ? hamming_distance(packed[j], packed[k])
+                      : get_num_mismatches(i7, other_i7);
+        if (i7 != other_i7 && num_mismatches <= 2 * max_errors_) {
           std::cerr
               << fmt::format(
                      "Found ambiguous i7 indices in lane {:3d} when allowing "
@@ -281,10 +308,16 @@ sample_index_map::sample_index_map(const std::string& sample_sheet,
     }
   }
   for (auto i = 0ul; i < i5_indices_.size(); ++i) {
-    for (auto& i5 : i5_indices_[i]) {
-      for (auto& other_i5 : i5_indices_[i]) {
-        if (i5 != other_i5 &&
-            get_num_mismatches(i5, other_i5) <= 2 * max_errors_) {
+    auto& packed = i5_packed_[i];
+    auto is_packed = packed.size() == i5_indices_[i].size();
+    for (auto j = 0ul; j < i5_indices_[i].size(); ++j) {
+      for (auto k = 0ul; k < i5_indices_[i].size(); ++k) {
+        auto& i5 = i5_indices_[i][j];
+        auto& other_i5 = i5_indices_[i][k];
+        auto num_mismatches =
+            is_packed ? hamming_distance(packed[j], packed[k])
+                      : get_num_mismatches(i5, other_i5);
+        if (i5 != other_i5 && num_mismatches <= 2 * max_errors_) {
           std::cerr
               << fmt::format(
                      "Found ambiguous i5 indices in lane {:3d} when allowing "
@@ -309,7 +342,17 @@ uint64_t sample_index_map::find_indices(nonstd::string_view i7,
   }
   auto it =
       std::find(i7_indices_[lane - 1].begin(), i7_indices_[lane - 1].end(), i7);
-  if (it == i7_indices_[lane - 1].end()) {
+  packed_sequence query;
+  auto& i7_packed = i7_packed_[lane - 1];
+  if (it == i7_indices_[lane - 1].end() &&
+      i7_packed.size() == i7_indices_[lane - 1].size() &&
+      i7.size() == i7_length_[lane - 1] && pack_sequence(i7, query)) {
+    uint32_t min_mismatches = 0;
+    auto min_i = closest_sequence(query, i7_packed, min_mismatches);
+    if (min_mismatches <= max_errors_) {
+      it = i7_indices_[lane - 1].begin() + static_cast<std::ptrdiff_t>(min_i);
+    }
+  } else if (it == i7_indices_[lane - 1].end()) {
     auto min_it = i7_indices_[lane - 1].end();
     auto min_mismatches = std::numeric_limits<uint64_t>::max();
     for (auto mit = i7_indices_[lane - 1].begin();
@@ -327,8 +370,15 @@ uint64_t sample_index_map::find_indices(nonstd::string_view i7,
   }
   if (it != i7_indices_[lane - 1].end()) {
     auto pos = std::distance(i7_indices_[lane - 1].begin(), it);
+    auto& i5_packed = i5_packed_[lane - 1];
     if (i5_indices_[lane - 1][static_cast<std::size_t>(pos)] == i5) {
       return static_cast<std::size_t>(pos);
+    } else if (i5_packed.size() == i5_indices_[lane - 1].size() &&
+               i5.size() == i5_length_[lane - 1] && pack_sequence(i5, query)) {
+      if (hamming_distance(i5_packed[static_cast<std::size_t>(pos)], query) <=
+          max_errors_) {
+        return static_cast<std::size_t>(pos);
+      }
     } else if (get_num_mismatches(i5_indices_[lane - 1][static_cast<std::size_t>(pos)], i5) <=
                max_errors_) {
       return static_cast<std::size_t>(pos);
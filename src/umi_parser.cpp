@@ -0,0 +1,310 @@
+#include <fumi_tools/umi_parser.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <fmt/format.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace fumi_tools {
+namespace {
+
+constexpr auto npos = nonstd::string_view::npos;
+constexpr nonstd::string_view fumi_tag(":FUMI|", 6);
+
+#ifdef __SSE2__
+inline __m128i load_block(const char* c) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i*>(c));
+}
+
+/** Bit i is set if byte i of block equals c. */
+inline uint32_t match_mask(__m128i block, char c) {
+  return static_cast<uint32_t>(
+      _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(c))));
+}
+#endif
+
+/** Position of the last c in str, or npos. */
+std::size_t rfind_char(nonstd::string_view str, char c) {
+  auto i = str.size();
+#ifdef __SSE2__
+  // the UMI is usually at the end, so this mostly needs a single block
+  for (; i >= 16; i -= 16) {
+    auto mask = match_mask(load_block(str.data() + i - 16), c);
+    if (mask != 0) {
+      return i - 16 + static_cast<std::size_t>(31 - __builtin_clz(mask));
+    }
+  }
+#endif
+  while (i > 0) {
+    --i;
+    if (str[i] == c) {
+      return i;
+    }
+  }
+  return npos;
+}
+
+/** Position of the first :FUMI| in qname, or npos. */
+std::size_t find_fumi_tag(nonstd::string_view qname) {
+  auto i = 0ul;
+#ifdef __SSE2__
+  // read ids contain many colons, so look for ':' followed by 'F'
+  for (; i + 17 <= qname.size(); i += 16) {
+    auto mask = match_mask(load_block(qname.data() + i), ':') &
+                match_mask(load_block(qname.data() + i + 1), 'F');
+    for (; mask != 0; mask &= mask - 1) {
+      auto pos = i + static_cast<std::size_t>(__builtin_ctz(mask));
+      if (qname.substr(pos, fumi_tag.size()) == fumi_tag) {
+        return pos;
+      }
+    }
+  }
+#endif
+  for (; i < qname.size(); ++i) {
+    if (qname[i] == ':' && qname.substr(i, fumi_tag.size()) == fumi_tag) {
+      return i;
+    }
+  }
+  return npos;
+}
+
+constexpr auto window_size = packed_sequence::max_length;
+
+/** Bit i of each mask is set if character i of a window matches. */
+struct window_masks {
+  uint32_t a = 0;
+  uint32_t c = 0;
+  uint32_t g = 0;
+  uint32_t t = 0;
+  uint32_t n = 0;
+  uint32_t delim = 0;
+  uint32_t stop = 0;
+
+  window_masks& operator>>=(uint32_t shift) {
+    a >>= shift;
+    c >>= shift;
+    g >>= shift;
+    t >>= shift;
+    n >>= shift;
+    delim >>= shift;
+    stop >>= shift;
+    return *this;
+  }
+};
+
+/** Matches all characters of interest of 32 bytes starting at window. */
+window_masks match_window(const char* window, char delim, char stop) {
+  window_masks res;
+#ifdef __SSE2__
+  auto lo = load_block(window);
+  auto hi = load_block(window + 16);
+  auto match = [lo, hi](char c) {
+    return match_mask(lo, c) | match_mask(hi, c) << 16u;
+  };
+  res.a = match('A');
+  res.c = match('C');
+  res.g = match('G');
+  res.t = match('T');
+  res.n = match('N');
+  res.delim = match(delim);
+  res.stop = match(stop);
+#else
+  for (auto i = 0u; i < window_size; ++i) {
+    auto bit = 1u << i;
+    res.a |= window[i] == 'A' ? bit : 0u;
+    res.c |= window[i] == 'C' ? bit : 0u;
+    res.g |= window[i] == 'G' ? bit : 0u;
+    res.t |= window[i] == 'T' ? bit : 0u;
+    res.n |= window[i] == 'N' ? bit : 0u;
+    res.delim |= window[i] == delim ? bit : 0u;
+    res.stop |= window[i] == stop ? bit : 0u;
+  }
+#endif
+  return res;
+}
+
+/**
+ * Packs the first length characters of masks, returns false if one of them
+ * is not ACGTN.
+ */
+bool pack_masks(const window_masks& masks, uint32_t length, umi_key& res) {
+  auto umi_bits = length == window_size ? ~0u : (1u << length) - 1u;
+  if (((masks.a | masks.c | masks.g | masks.t | masks.n) & umi_bits) !=
+      umi_bits) {
+    return false;
+  }
+  // A = 00, C = 01, G = 10, T = 11
+  res = umi_key(spread_bits((masks.c | masks.t) & umi_bits) |
+                    spread_bits((masks.g | masks.t) & umi_bits) << 1u,
+                masks.n & umi_bits, length);
+  return true;
+}
+
+/**
+ * Packs the UMI at the start of rest, which ends before the first stop
+ * character or, unless needs_stop is set, at the end of rest. Returns false
+ * if the UMI is longer than 32 bases, contains other characters than ACGTN
+ * or its end was not found, these are left to the scalar path.
+ */
+bool pack_umi(nonstd::string_view rest,
+              char stop,
+              bool needs_stop,
+              umi_key& res) {
+  const auto* window = rest.data();
+  char padded[window_size] = {};
+  if (rest.size() < window_size) {
+    std::memcpy(padded, rest.data(), rest.size());
+    window = padded;
+  }
+  auto masks = match_window(window, stop, stop);
+  if (rest.size() < window_size) {
+    // ignore the padding
+    masks.stop &= (1u << rest.size()) - 1u;
+  }
+
+  if (masks.stop != 0) {
+    return pack_masks(
+        masks, static_cast<uint32_t>(__builtin_ctz(masks.stop)), res);
+  }
+  if (rest.size() <= window_size && !needs_stop) {
+    return pack_masks(masks, static_cast<uint32_t>(rest.size()), res);
+  }
+  if (rest.size() > window_size && rest[window_size] == stop) {
+    return pack_masks(masks, window_size, res);
+  }
+  return false;
+}
+
+/**
+ * Finds the last underscore and packs the following UMI in a single pass
+ * over the last 32 characters of qname, which covers UMIs of up to 31 bases
+ * at the end of the read name.
+ */
+bool pack_underscore_umi(nonstd::string_view qname, umi_key& res) {
+  if (qname.size() < window_size) {
+    return false;
+  }
+  auto masks =
+      match_window(qname.data() + qname.size() - window_size, '_', ' ');
+  if (masks.delim == 0 || (masks.delim >> (window_size - 1)) != 0) {
+    return false;
+  }
+  auto beg = window_size - static_cast<uint32_t>(__builtin_clz(masks.delim));
+  masks >>= beg;
+  auto length = masks.stop != 0
+                    ? static_cast<uint32_t>(__builtin_ctz(masks.stop))
+                    : static_cast<uint32_t>(window_size - beg);
+  return pack_masks(masks, length, res);
+}
+}  // namespace
+
+UMI_FORMAT determine_umi_format(nonstd::string_view qname) {
+  auto fmt = UMI_FORMAT::FUMI_TAG;
+  auto pos = qname.find(fumi_tag);
+  nonstd::string_view umi;
+  if (pos == npos) {
+    pos = qname.rfind('_');
+    fmt = UMI_FORMAT::UNDERSCORE;
+    if (pos != npos) {
+      umi = qname.substr(pos + 1);
+      auto pos2 = umi.find(' ');
+      if (pos2 != npos) {
+        umi = umi.substr(0, pos2);
+      }
+    }
+  } else {
+    umi = qname.substr(pos + fumi_tag.size());
+    auto pos2 = umi.find('|');
+    if (pos2 != npos) {
+      umi = umi.substr(0, pos2);
+    } else {
+      pos = npos;
+    }
+  }
+  if (pos == npos) {
+    throw std::runtime_error(
+        fmt::format("Did not find UMI for read {}!", qname.to_string()));
+  }
+  if (umi.find_first_not_of("ACGTN") != npos) {
+    throw std::runtime_error(fmt::format(
+        "Could not identify a valid UMI for read {}!", qname.to_string()));
+  }
+  return fmt;
+}
+
+nonstd::string_view get_umi(nonstd::string_view qname, UMI_FORMAT fmt) {
+  if (fmt == UMI_FORMAT::UNDERSCORE) {
+    auto pos = qname.rfind('_');
+    if (pos == npos) {
+      throw std::runtime_error(
+          fmt::format("Did not find umi for read {}!", qname.to_string()));
+    }
+    auto umi = qname.substr(pos + 1);
+    auto pos2 = umi.find(' ');
+    if (pos2 == npos) {
+      return umi;
+    } else {
+      return umi.substr(0, pos2);
+    }
+  } else if (fmt == UMI_FORMAT::FUMI_TAG) {
+    auto pos = qname.find(fumi_tag);
+    if (pos == npos) {
+      throw std::runtime_error(
+          fmt::format("Did not find umi for read {}!", qname.to_string()));
+    }
+    auto umi = qname.substr(pos + fumi_tag.size());
+    auto pos2 = umi.find('|');
+    if (pos2 != npos) {
+      return umi.substr(0, pos2);
+    } else {
+      throw std::runtime_error(
+          fmt::format("Did not find umi for read {}!", qname.to_string()));
+    }
+  } else {
+    throw std::runtime_error("Unknown UMI format!");
+  }
+}
+
+umi_key parse_umi(nonstd::string_view qname, UMI_FORMAT fmt) {
+  umi_key res;
+  if (fmt == UMI_FORMAT::UNDERSCORE) {
+    if (pack_underscore_umi(qname, res)) {
+      return res;
+    }
+    auto pos = rfind_char(qname, '_');
+    if (pos != npos && pack_umi(qname.substr(pos + 1), ' ', false, res)) {
+      return res;
+    }
+  } else if (fmt == UMI_FORMAT::FUMI_TAG) {
+    auto pos = find_fumi_tag(qname);
+    if (pos != npos &&
+        pack_umi(qname.substr(pos + fumi_tag.size()), '|', true, res)) {
+      return res;
+    }
+  }
+  return umi_key(get_umi(qname, fmt));
+}
+
+umi_key parse_umi_tag(const bam1_t* record, const char tag[2]) {
+  const auto* aux = bam_aux_get(record, tag);
+  const char* value = aux != nullptr ? bam_aux2Z(aux) : nullptr;
+  if (value == nullptr) {
+    throw std::runtime_error(
+        fmt::format("Did not find UMI tag {} for read {}!",
+                    std::string(tag, 2), bam_get_qname(record)));
+  }
+  auto umi = nonstd::string_view(value);
+  umi_key res;
+  if (pack_umi(umi, '\0', false, res)) {
+    return res;
+  }
+  return umi_key(umi);
+}
+
+}  // namespace fumi_tools
@@ -0,0 +1,370 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+#include <htslib/sam.h>
+
+#include <fumi_tools/read_flags.hpp>
+
+namespace {
+
+constexpr uint64_t num_reads = 20000;
+constexpr int32_t read_length = 50;
+constexpr uint64_t sort_memory = 256ul << 20u;
+// small enough to spill several levels of partitions and runs
+constexpr uint64_t spill_memory = 64ul << 10u;
+
+/**
+ * Writes a name grouped SAM file with single alignments and multimappers.
+ * The NH tags are right, as --unsorted needs them to group the reads, while
+ * the flags and the HI and XS tags are left for fix_flags to fix.
+ */
+void write_input(const std::string& path) {
+  std::mt19937_64 rand_gen(42);
+  const std::string seq(read_length, 'A');
+  const std::string qual(read_length, 'I');
+
+  std::ofstream out(path);
+  out << "@HD\tVN:1.6\tSO:queryname\n"
+      << "@SQ\tSN:chr1\tLN:10000000\n"
+      << "@SQ\tSN:chr2\tLN:10000000\n";
+  for (auto i = 0ul; i < num_reads; ++i) {
+    // zero padded, so the names are already in lexicographical order
+    auto name = fmt::format("r{:08}", i);
+    auto kind = rand_gen() % 50;
+    uint64_t num_alignments = 1;
+    if (kind == 0) {
+      // more hits than HI:C can hold
+      num_alignments = 260 + rand_gen() % 50;
+    } else if (kind < 25) {
+      num_alignments = 2 + rand_gen() % 5;
+    }
+    auto paired = rand_gen() % 2 == 0;
+    for (auto j = 0ul; j < num_alignments; ++j) {
+      auto tid = rand_gen() % 2;
+      auto pos = rand_gen() % 9000000;
+      auto mapq = rand_gen() % 4 == 0 ? 255 : rand_gen() % 60;
+      // scores above 255 do not fit an XS:C or XS:c of a smaller score
+      auto as = static_cast<int64_t>(rand_gen() % 400) - 50;
+      auto xs = static_cast<int64_t>(rand_gen() % 400) - 50;
+      auto secondary = rand_gen() % 2 == 0 ? 0x100 : 0;
+      for (auto mate = 0; mate < (paired ? 2 : 1); ++mate) {
+        int flag = secondary;
+        if (paired) {
+          flag |= 0x1 | 0x2 | (mate == 0 ? 0x40 | 0x20 : 0x80 | 0x10);
+        } else if (rand_gen() % 2 == 0) {
+          flag |= 0x10;
+        }
+        auto read_pos = pos + (mate == 0 ? 0 : 150);
+        auto mate_pos = mate == 0 ? pos + 150 : pos;
+        out << fmt::format(
+            "{}\t{}\tchr{}\t{}\t{}\t{}M\t{}\t{}\t{}\t{}\t{}\tNH:i:{}\tHI:i:{}"
+            "\tAS:i:{}\tXS:i:{}\n",
+            name, flag, tid + 1, read_pos + 1, mapq, read_length,
+            paired ? "=" : "*", paired ? mate_pos + 1 : 0,
+            paired ? (mate == 0 ? 200 : -200) : 0, seq, qual,
+            num_alignments, rand_gen() % 3 + 1, as, xs);
+      }
+    }
+    if (rand_gen() % 20 == 0) {
+      // unmapped reads are dropped
+      out << fmt::format("{}\t4\t*\t0\t0\t*\t*\t0\t0\t{}\t{}\n", name, seq,
+                         qual);
+    }
+  }
+}
+
+template <class T>
+bool append_int(bam1_t* record, const char tag[2], char type, int64_t val) {
+  if (val < std::numeric_limits<T>::min() ||
+      val > std::numeric_limits<T>::max()) {
+    return false;
+  }
+  auto v = static_cast<T>(val);
+  bam_aux_append(record, tag, type, sizeof(v), reinterpret_cast<uint8_t*>(&v));
+  return true;
+}
+
+/**
+ * Stores an integer tag with a random type that holds its value. Parsing SAM
+ * always picks the smallest type, BAM files of other tools may use wider
+ * ones, which fix_flags keeps when the fixed value fits.
+ */
+void retype_int(bam1_t* record, const char tag[2], std::mt19937_64& rand_gen) {
+  auto* s = bam_aux_get(record, tag);
+  auto val = bam_aux2i(s);
+  bam_aux_del(record, s);
+  while (true) {
+    switch (rand_gen() % 6) {
+      case 0:
+        if (append_int<int8_t>(record, tag, 'c', val)) return;
+        break;
+      case 1:
+        if (append_int<uint8_t>(record, tag, 'C', val)) return;
+        break;
+      case 2:
+        if (append_int<int16_t>(record, tag, 's', val)) return;
+        break;
+      case 3:
+        if (append_int<uint16_t>(record, tag, 'S', val)) return;
+        break;
+      case 4:
+        if (append_int<int32_t>(record, tag, 'i', val)) return;
+        break;
+      default:
+        if (append_int<uint32_t>(record, tag, 'I', val)) return;
+        break;
+    }
+  }
+}
+
+/** Converts the SAM input to BAM, storing the tags with random widths. */
+void convert(const std::string& input, const std::string& output) {
+  std::mt19937_64 rand_gen(42);
+  samFile* in = hts_open(input.c_str(), "r");
+  samFile* out = hts_open(output.c_str(), "wb");
+  if (in == nullptr || out == nullptr) {
+    std::cerr << fmt::format("Could not convert '{}' to '{}'", input, output)
+              << std::endl;
+    std::exit(1);
+  }
+  bam_hdr_t* hdr = sam_hdr_read(in);
+  if (sam_hdr_write(out, hdr) < 0) {
+    std::cerr << fmt::format("Could not write header to '{}'", output)
+              << std::endl;
+    std::exit(1);
+  }
+  bam1_t* record = bam_init1();
+  while (sam_read1(in, hdr, record) >= 0) {
+    if ((record->core.flag & BAM_FUNMAP) == 0) {
+      for (auto tag : {"NH", "HI", "AS", "XS"}) {
+        retype_int(record, tag, rand_gen);
+      }
+    }
+    if (sam_write1(out, hdr, record) < 0) {
+      std::cerr << fmt::format("Could not write to '{}'", output) << std::endl;
+      std::exit(1);
+    }
+  }
+  bam_destroy1(record);
+  bam_hdr_destroy(hdr);
+  hts_close(in);
+  hts_close(out);
+}
+
+/**
+ * Writes the records of input in random order, but keeps the order of the
+ * alignments of each read, as an aligner that is not sorted by name would.
+ */
+void shuffle(const std::string& input, const std::string& output) {
+  std::mt19937_64 rand_gen(42);
+  samFile* in = hts_open(input.c_str(), "r");
+  samFile* out = hts_open(output.c_str(), "wb");
+  if (in == nullptr || out == nullptr) {
+    std::cerr << fmt::format("Could not shuffle '{}' to '{}'", input, output)
+              << std::endl;
+    std::exit(1);
+  }
+  bam_hdr_t* hdr = sam_hdr_read(in);
+  if (sam_hdr_write(out, hdr) < 0) {
+    std::cerr << fmt::format("Could not write header to '{}'", output)
+              << std::endl;
+    std::exit(1);
+  }
+  // random key per record, the keys of a read are sorted such that its
+  // alignments stay in order
+  std::vector<std::pair<uint64_t, bam1_t*>> records;
+  std::vector<uint64_t> keys;
+  std::string last_name;
+  auto assign_keys = [&records, &keys]() {
+    std::sort(keys.begin(), keys.end());
+    for (auto i = 0ul; i < keys.size(); ++i) {
+      records[records.size() - keys.size() + i].first = keys[i];
+    }
+    keys.clear();
+  };
+  bam1_t* record = bam_init1();
+  while (sam_read1(in, hdr, record) >= 0) {
+    if (bam_get_qname(record) != last_name) {
+      assign_keys();
+      last_name = bam_get_qname(record);
+    }
+    keys.push_back(rand_gen());
+    records.emplace_back(0, bam_dup1(record));
+  }
+  assign_keys();
+  std::sort(records.begin(), records.end(),
+            [](const auto& lhs, const auto& rhs) {
+              return lhs.first < rhs.first;
+            });
+  for (auto& r : records) {
+    if (sam_write1(out, hdr, r.second) < 0) {
+      std::cerr << fmt::format("Could not write to '{}'", output) << std::endl;
+      std::exit(1);
+    }
+    bam_destroy1(r.second);
+  }
+  bam_destroy1(record);
+  bam_hdr_destroy(hdr);
+  hts_close(in);
+  hts_close(out);
+}
+
+/** Record as its core fields followed by its variable length data. */
+struct output_record {
+  std::string name;
+  std::string bytes;
+};
+
+bool operator==(const output_record& lhs, const output_record& rhs) {
+  return lhs.bytes == rhs.bytes;
+}
+
+std::vector<output_record> read_records(const std::string& path) {
+  std::vector<output_record> res;
+  samFile* in = hts_open(path.c_str(), "r");
+  if (in == nullptr) {
+    std::cerr << fmt::format("Could not open file '{}'", path) << std::endl;
+    std::exit(1);
+  }
+  bam_hdr_t* hdr = sam_hdr_read(in);
+  bam1_t* record = bam_init1();
+  while (sam_read1(in, hdr, record) >= 0) {
+    const auto& c = record->core;
+    auto bytes = fmt::format("{} {} {} {} {} {} {} {} {} {} {} ", c.tid, c.pos,
+                             c.bin, c.qual, c.l_qname, c.flag, c.n_cigar,
+                             c.l_qseq, c.mtid, c.mpos, c.isize);
+    bytes.append(reinterpret_cast<const char*>(record->data),
+                 static_cast<std::size_t>(record->l_data));
+    res.push_back({bam_get_qname(record), std::move(bytes)});
+  }
+  bam_destroy1(record);
+  bam_hdr_destroy(hdr);
+  hts_close(in);
+  return res;
+}
+
+/**
+ * Joins the records of each read, which are adjacent, and sorts the reads,
+ * for output whose order of reads depends on the input order.
+ */
+std::vector<output_record> by_read(const std::vector<output_record>& records) {
+  std::vector<output_record> res;
+  for (auto& record : records) {
+    if (res.empty() || res.back().name != record.name) {
+      res.push_back({record.name, ""});
+    }
+    res.back().bytes += record.bytes;
+  }
+  std::sort(res.begin(), res.end(), [](const auto& lhs, const auto& rhs) {
+    return lhs.name < rhs.name;
+  });
+  return res;
+}
+
+struct fix_flags_mode {
+  std::string name;
+  bool shuffled;
+  bool name_sort;
+  bool unsorted;
+  uint64_t threads;
+  uint64_t memory;
+  bool copy_raw;
+};
+}  // namespace
+
+/**
+ * Fixes the flags of a generated multimapper BAM file in every mode and
+ * checks that the records are the same as those of the single-threaded run
+ * that decodes every read. Otherwise a single thread takes the raw path,
+ * which patches single alignments in their raw records. --name-sort and
+ * --unsorted also get the reads in random order, and run with little memory
+ * such that they spill to temporary files. The reads written by --unsorted
+ * are compared regardless of their order. Returns 1 if any mode differs.
+ */
+int main() {
+  const char* tmp_dir = std::getenv("TMPDIR");
+  auto prefix = fmt::format("{}/fumi_tools_fix_flags_check",
+                            tmp_dir != nullptr ? tmp_dir : "/tmp");
+  auto sam_input = prefix + ".sam";
+  auto bam_input = prefix + ".bam";
+  auto shuffled_input = prefix + "_shuffled.bam";
+  write_input(sam_input);
+  convert(sam_input, bam_input);
+  shuffle(bam_input, shuffled_input);
+
+  const std::vector<fix_flags_mode> modes = {
+      {"decoded", false, false, false, 1, sort_memory, false},
+      {"raw", false, false, false, 1, sort_memory, true},
+      {"threads=2", false, false, false, 2, sort_memory, true},
+      {"threads=4", false, false, false, 4, sort_memory, true},
+      {"--unsorted", false, false, true, 1, sort_memory, true},
+      {"--unsorted threads=4", false, false, true, 4, sort_memory, true},
+      {"--name-sort", false, true, false, 1, sort_memory, true},
+      {"--name-sort threads=4", false, true, false, 4, sort_memory, true},
+      {"shuffled --unsorted", true, false, true, 1, sort_memory, true},
+      {"shuffled --unsorted spilled", true, false, true, 1, spill_memory,
+       true},
+      {"shuffled --unsorted spilled threads=4", true, false, true, 4,
+       spill_memory, true},
+      {"shuffled --name-sort spilled", true, true, false, 1, spill_memory,
+       true},
+      {"shuffled --name-sort spilled threads=4", true, true, false, 4,
+       spill_memory, true},
+  };
+
+  bool ok = true;
+  for (auto sort_rsem : {false, true}) {
+    std::vector<output_record> expected;
+    for (const auto& mode : modes) {
+      auto output = prefix + "_fixed.bam";
+      fumi_tools::fix_flags(mode.shuffled ? shuffled_input : bam_input, output,
+                            sort_rsem, mode.name_sort, mode.unsorted,
+                            mode.memory, mode.threads, 1, 1, mode.copy_raw);
+      auto records = read_records(output);
+      std::remove(output.c_str());
+      auto name = fmt::format("{} sort_rsem={}", mode.name, sort_rsem);
+      if (expected.empty()) {
+        expected = std::move(records);
+        std::cout << fmt::format("{:<60} {} records", name, expected.size())
+                  << std::endl;
+        continue;
+      }
+      if (records.size() != expected.size()) {
+        ok = false;
+        std::cout << fmt::format("{:<60} {} records instead of {}", name,
+                                 records.size(), expected.size())
+                  << std::endl;
+        continue;
+      }
+      auto ordered = !(mode.shuffled && mode.unsorted);
+      auto reads = ordered ? std::move(records) : by_read(records);
+      auto expected_reads = ordered ? expected : by_read(expected);
+      auto mismatch =
+          std::mismatch(reads.begin(), reads.end(), expected_reads.begin());
+      if (mismatch.first != reads.end()) {
+        ok = false;
+        std::cout << fmt::format("{:<60} differs at {} {}", name,
+                                 ordered ? "record" : "read",
+                                 mismatch.first - reads.begin())
+                  << std::endl;
+      } else {
+        std::cout << fmt::format("{:<60} identical", name) << std::endl;
+      }
+    }
+  }
+
+  std::remove(sam_input.c_str());
+  std::remove(bam_input.c_str());
+  std::remove(shuffled_input.c_str());
+  return ok ? 0 : 1;
+}